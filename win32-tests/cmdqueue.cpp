@@ -0,0 +1,164 @@
+﻿#include <string.h>
+
+#include "cmdqueue.h"
+
+CommandQueue::CommandQueue(int capacityLog2)
+    : capacity(1u << capacityLog2)
+    , writePos(0)
+    , readPos(0)
+    , lastReleased(0)
+    , committedSeen(0)
+    , releasedSeen(0)
+    , committed(0)
+    , released(0)
+    , readerWaiting(0)
+    , writerWaiting(0)
+    , closed(0)
+{
+    buffer = new unsigned char[capacity];
+    readerEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    writerEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+}
+
+CommandQueue::~CommandQueue()
+{
+    CloseHandle(readerEvent);
+    CloseHandle(writerEvent);
+    delete[] buffer;
+}
+
+unsigned int CommandQueue::load(volatile LONG& value)
+{
+    return (unsigned int)InterlockedCompareExchange(&value, 0, 0);
+}
+
+void CommandQueue::store(volatile LONG& value, unsigned int pos)
+{
+    InterlockedExchange(&value, (LONG)pos);
+}
+
+void CommandQueue::write(const void* data, size_t size)
+{
+    const unsigned char* src = (const unsigned char*)data;
+    while (size > 0)
+    {
+        unsigned int space = capacity - (writePos - releasedSeen);
+        if (space == 0) 
+        {
+            releasedSeen = load(released);
+            if (writePos - releasedSeen == capacity) 
+            {
+                // Let the reader make room, then sleep until it has. The 
+                // flag goes up before the last check, so a release in 
+                // between still signals the event.
+                commit();
+                store(writerWaiting, 1);
+                if (writePos - load(released) == capacity) {
+                    WaitForSingleObject(writerEvent, INFINITE);
+                }
+            }
+            continue;
+        }
+
+        unsigned int offset = writePos & (capacity-1);
+        unsigned int chunk = capacity - offset;
+        if (chunk > space) {
+            chunk = space;
+        }
+        if (chunk > size) {
+            chunk = (unsigned int)size;
+        }
+
+        memcpy(buffer + offset, src, chunk);
+        writePos += chunk;
+        src += chunk;
+        size -= chunk;
+    }
+}
+
+void CommandQueue::commit()
+{
+    store(committed, writePos);
+    if (InterlockedExchange(&readerWaiting, 0) != 0) {
+        SetEvent(readerEvent);
+    }
+}
+
+void CommandQueue::waitIdle()
+{
+    commit();
+    while (load(released) != writePos)
+    {
+        store(writerWaiting, 1);
+        if (load(released) != writePos) {
+            WaitForSingleObject(writerEvent, INFINITE);
+        }
+    }
+    releasedSeen = writePos;
+}
+
+void CommandQueue::close()
+{
+    commit();
+    store(closed, 1);
+    SetEvent(readerEvent);
+}
+
+void CommandQueue::release()
+{
+    store(released, readPos);
+    lastReleased = readPos;
+    if (InterlockedExchange(&writerWaiting, 0) != 0) {
+        SetEvent(writerEvent);
+    }
+}
+
+bool CommandQueue::read(void* data, size_t size)
+{
+    unsigned char* dst = (unsigned char*)data;
+    while (size > 0)
+    {
+        unsigned int available = committedSeen - readPos;
+        if (available == 0) 
+        {
+            committedSeen = load(committed);
+            if (committedSeen != readPos) {
+                continue;
+            }
+
+            // Everything read so far is done with, the writer may be 
+            // waiting for room or for the reader to go idle
+            release();
+            if (load(closed) != 0 && load(committed) == readPos) {
+                return false;
+            }
+
+            store(readerWaiting, 1);
+            if (load(committed) == readPos && load(closed) == 0) {
+                WaitForSingleObject(readerEvent, INFINITE);
+            }
+            continue;
+        }
+
+        unsigned int offset = readPos & (capacity-1);
+        unsigned int chunk = capacity - offset;
+        if (chunk > available) {
+            chunk = available;
+        }
+        if (chunk > size) {
+            chunk = (unsigned int)size;
+        }
+
+        memcpy(dst, buffer + offset, chunk);
+        readPos += chunk;
+        dst += chunk;
+        size -= chunk;
+
+        // Free up room in big steps, not for every read. Having read all
+        // there is isn't released here, the caller isn't done with it yet.
+        if (readPos - lastReleased >= capacity/4 && readPos != committedSeen) {
+            release();
+        }
+    }
+    return true;
+}
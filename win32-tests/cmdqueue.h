@@ -0,0 +1,60 @@
+﻿#pragma once
+
+#include <windows.h>
+
+// Byte queue between one writer and one reader thread. Neither side 
+// takes a lock: positions are published with interlocked writes, and a 
+// side only sleeps on an event when the queue is full or empty. Writes 
+// bigger than the queue are streamed through it.
+struct CommandQueue
+{
+public:
+    // Holds 1 << capacityLog2 bytes
+    explicit CommandQueue(int capacityLog2);
+    ~CommandQueue();
+
+    // Writer side. Bytes become visible to the reader at commit(), or 
+    // when a write has to wait for room.
+    void write(const void* data, size_t size);
+    void commit();
+    // Commits and waits until the reader has consumed everything and 
+    // asked for more, meaning it's done with what it read
+    void waitIdle();
+    // Commits, the reader gets false once it drains the rest
+    void close();
+
+    // Reader side, blocks until size bytes arrived. Returns false if the
+    // queue got closed first.
+    bool read(void* data, size_t size);
+
+private:
+    CommandQueue(const CommandQueue&);
+    CommandQueue& operator=(const CommandQueue&);
+
+    static unsigned int load(volatile LONG& value);
+    static void store(volatile LONG& value, unsigned int pos);
+
+    // Publishes what the reader consumed, wakes the writer if it waits
+    void release();
+
+    unsigned int capacity;
+    unsigned char* buffer;
+
+    // Free running positions, wrapped into the buffer by capacity-1
+    unsigned int writePos;
+    unsigned int readPos;
+    unsigned int lastReleased;
+
+    // Last values seen from the other side, to skip interlocked reads
+    unsigned int committedSeen;
+    unsigned int releasedSeen;
+
+    volatile LONG committed;
+    volatile LONG released;
+    volatile LONG readerWaiting;
+    volatile LONG writerWaiting;
+    volatile LONG closed;
+
+    HANDLE readerEvent;
+    HANDLE writerEvent;
+};
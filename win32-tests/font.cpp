@@ -0,0 +1,412 @@
+﻿#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "font.h"
+
+namespace {
+
+template <class T>
+T maxOf(const T& a, const T& b)
+{
+    return a > b ? a : b;
+}
+
+template <class T>
+T minOf(const T& a, const T& b)
+{
+    return a < b ? a : b;
+}
+
+unsigned int hashText(const char* text)
+{
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (const char* c = text; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return hash;
+}
+
+inline int sampleCoverage(const unsigned char* src, int sw, int sh, int x, int y)
+{
+    if (x < 0 || y < 0 || x >= sw || y >= sh) {
+        return 0;
+    }
+    return src[y*sw + x];
+}
+
+// Turns an upscaled coverage bitmap into a signed distance field at 
+// 1/upscale resolution, padded by spread pixels on every side. 0.5 is 
+// the glyph edge, inside is above it.
+void makeDistanceField(const unsigned char* src, int sw, int sh, int upscale, int spread,
+                       unsigned char* dst, int dw, int dh)
+{
+    int radius = spread * upscale;
+    for (int dy=0; dy<dh; dy++) {
+        for (int dx=0; dx<dw; dx++) 
+        {
+            int cx = (dx - spread) * upscale + upscale/2;
+            int cy = (dy - spread) * upscale + upscale/2;
+            bool inside = sampleCoverage(src, sw, sh, cx, cy) >= 128;
+
+            // Everything outside the bitmap is outside the glyph, so there's
+            // no point looking further than one texel beyond its border
+            int x0 = maxOf(cx - radius, -1);
+            int x1 = minOf(cx + radius, sw);
+            int y0 = maxOf(cy - radius, -1);
+            int y1 = minOf(cy + radius, sh);
+
+            int best = radius*radius;
+            for (int sy=y0; sy<=y1; sy++) {
+                for (int sx=x0; sx<=x1; sx++) 
+                {
+                    bool sInside = sampleCoverage(src, sw, sh, sx, sy) >= 128;
+                    if (sInside != inside) 
+                    {
+                        int d = (sx-cx)*(sx-cx) + (sy-cy)*(sy-cy);
+                        if (d < best) {
+                            best = d;
+                        }
+                    }
+                }
+            }
+
+            float dist = sqrtf((float)best) / upscale;
+            float value = 0.5f + (inside ? dist : -dist) / (2.f * spread);
+            if (value < 0.f) {
+                value = 0.f;
+            } else if (value > 1.f) {
+                value = 1.f;
+            }
+            dst[dy*dw + dx] = (unsigned char)(value * 255.f + 0.5f);
+        }
+    }
+}
+
+}  // anonymous namespace
+
+FontAtlas::FontAtlas(bool aSdf)
+    : hTexture(-1)
+    , sdf(aSdf)
+    , pixels(new unsigned char[PAGE_SIZE*PAGE_SIZE*4])
+    , generation(0)
+{
+    reset();
+}
+
+FontAtlas::~FontAtlas()
+{
+    delete[] pixels;
+}
+
+bool FontAtlas::allocate(int w, int h, int& x, int& y)
+{
+    if (w > PAGE_SIZE || h > PAGE_SIZE) {
+        return false;
+    }
+
+    // Simple shelf packer, glyphs of one font have similar heights
+    if (shelfX + w > PAGE_SIZE) 
+    {
+        shelfY += shelfH;
+        shelfX = 0;
+        shelfH = 0;
+    }
+    if (shelfY + h > PAGE_SIZE) {
+        return false;
+    }
+
+    x = shelfX;
+    y = shelfY;
+    shelfX += w;
+    shelfH = maxOf(shelfH, h);
+
+    return true;
+}
+
+void FontAtlas::write(int x, int y, int w, int h, const unsigned char* alpha)
+{
+    for (int row=0; row<h; row++) 
+    {
+        unsigned char* dst = &pixels[((y+row)*PAGE_SIZE + x)*4];
+        const unsigned char* src = &alpha[row*w];
+        for (int col=0; col<w; col++) 
+        {
+            dst[col*4+0] = 255;
+            dst[col*4+1] = 255;
+            dst[col*4+2] = 255;
+            dst[col*4+3] = src[col];
+        }
+    }
+
+    dirtyY0 = minOf(dirtyY0, y);
+    dirtyY1 = maxOf(dirtyY1, y+h);
+}
+
+void FontAtlas::reset()
+{
+    // Transparent white, so filtering at glyph borders doesn't darken them
+    for (int i=0; i<PAGE_SIZE*PAGE_SIZE; i++) 
+    {
+        pixels[i*4+0] = 255;
+        pixels[i*4+1] = 255;
+        pixels[i*4+2] = 255;
+        pixels[i*4+3] = 0;
+    }
+
+    shelfX = 0;
+    shelfY = 0;
+    shelfH = 0;
+
+    dirtyY0 = 0;
+    dirtyY1 = PAGE_SIZE;
+
+    generation++;
+}
+
+bool FontAtlas::getDirtyRows(int& y0, int& y1) const
+{
+    y0 = dirtyY0;
+    y1 = dirtyY1;
+    return y0 < y1;
+}
+
+void FontAtlas::clearDirty()
+{
+    dirtyY0 = PAGE_SIZE;
+    dirtyY1 = 0;
+}
+
+Font::Font(GlyphRasterizer* aRasterizer, FontAtlas* aAtlas, int aUpscale)
+    : rasterizer(aRasterizer)
+    , atlas(aAtlas)
+    , upscale(aAtlas->isSdf() ? aUpscale : 1)
+    , scratchMax(256*256)
+{
+    ascent = (float)rasterizer->getAscent() / upscale;
+    lineHeight = (float)rasterizer->getLineHeight() / upscale;
+
+    memset(glyphs, 0, sizeof(glyphs));
+    for (int i=0; i<GLYPHS_LEN; i++) {
+        glyphs[i].generation = -1;
+    }
+    memset(runs, 0, sizeof(runs));
+
+    scratch = new unsigned char[scratchMax];
+    field = new unsigned char[scratchMax];
+}
+
+Font::~Font()
+{
+    for (int i=0; i<RUNS_LEN; i++) 
+    {
+        delete[] runs[i].text;
+        delete[] runs[i].quads;
+    }
+    delete[] scratch;
+    delete[] field;
+    delete rasterizer;
+}
+
+const TextQuad* Font::layout(const char* text, int& quadsLen)
+{
+    unsigned int hash = hashText(text);
+    Run& run = runs[hash % RUNS_LEN];
+
+    bool cached = run.text != NULL 
+        && run.hash == hash 
+        && run.generation == atlas->getGeneration()
+        && strcmp(run.text, text) == 0;
+    if (!cached) {
+        buildRun(text, hash, run);
+    }
+
+    quadsLen = run.quadsLen;
+    return run.quads;
+}
+
+float Font::measure(const char* text)
+{
+    int quadsLen = 0;
+    layout(text, quadsLen);
+    return runs[hashText(text) % RUNS_LEN].width;
+}
+
+Font::Run* Font::buildRun(const char* text, unsigned int hash, Run& run)
+{
+    int textLen = (int)strlen(text);
+
+    delete[] run.text;
+    delete[] run.quads;
+    run.text = new char[textLen+1];
+    memcpy(run.text, text, textLen+1);
+    run.hash = hash;
+    run.quads = new TextQuad[textLen > 0 ? textLen : 1];
+
+    // Loading a glyph may wipe a full atlas page, which invalidates the 
+    // glyphs laid out so far, so start over once if that happens
+    for (int attempt=0; attempt<2; attempt++)
+    {
+        int generation = atlas->getGeneration();
+        float penX = 0.f;
+        float penY = 0.f;
+        run.quadsLen = 0;
+        run.width = 0.f;
+
+        for (int i=0; i<textLen; i++)
+        {
+            unsigned char ch = (unsigned char)text[i];
+            if (ch == '\n') 
+            {
+                penX = 0.f;
+                penY += lineHeight;
+                continue;
+            }
+
+            const Glyph& g = getGlyph(ch);
+            if (g.visible) 
+            {
+                TextQuad& q = run.quads[run.quadsLen++];
+                q.x = penX + g.x;
+                q.y = penY + g.y;
+                q.w = g.w;
+                q.h = g.h;
+                q.tx = g.tx;
+                q.ty = g.ty;
+                q.tw = g.tw;
+                q.th = g.th;
+            }
+            penX += g.advance;
+            run.width = maxOf(run.width, penX);
+        }
+
+        run.generation = atlas->getGeneration();
+        if (run.generation == generation) {
+            break;
+        }
+    }
+
+    return &run;
+}
+
+const Font::Glyph& Font::getGlyph(unsigned char ch)
+{
+    Glyph& glyph = glyphs[ch];
+    if (glyph.generation != atlas->getGeneration()) 
+    {
+        if (loadGlyph(ch, glyph) == false) {
+            glyph.visible = false;
+        }
+        glyph.generation = atlas->getGeneration();
+    }
+    return glyph;
+}
+
+bool Font::loadGlyph(unsigned char ch, Glyph& glyph)
+{
+    GlyphMetrics m;
+    memset(&m, 0, sizeof(m));
+    glyph.advance = 0.f;
+
+    if (rasterizer->rasterize(ch, scratch, scratchMax, m) == false) {
+        return false;
+    }
+    glyph.advance = (float)m.advance / upscale;
+    if (m.w <= 0 || m.h <= 0) {
+        return false;
+    }
+
+    const unsigned char* alpha = scratch;
+    int w = m.w;
+    int h = m.h;
+    float x = (float)m.originX;
+    float y = ascent - m.originY;
+
+    if (atlas->isSdf())
+    {
+        w = (m.w + upscale-1) / upscale + 2*SDF_SPREAD;
+        h = (m.h + upscale-1) / upscale + 2*SDF_SPREAD;
+        if (w*h > scratchMax) {
+            return false;
+        }
+        makeDistanceField(scratch, m.w, m.h, upscale, SDF_SPREAD, field, w, h);
+        alpha = field;
+        x = (float)m.originX / upscale - SDF_SPREAD;
+        y = ascent - (float)m.originY / upscale - SDF_SPREAD;
+    }
+
+    // One texel of padding keeps neighbours out of the filter footprint
+    int ax = 0;
+    int ay = 0;
+    if (atlas->allocate(w+1, h+1, ax, ay) == false)
+    {
+        atlas->reset();
+        if (atlas->allocate(w+1, h+1, ax, ay) == false) {
+            return false;
+        }
+    }
+    atlas->write(ax, ay, w, h, alpha);
+
+    static const float TEXEL = 1.f / FontAtlas::PAGE_SIZE;
+    glyph.x = x;
+    glyph.y = y;
+    glyph.w = (float)w;
+    glyph.h = (float)h;
+    glyph.tx = ax * TEXEL;
+    glyph.ty = ay * TEXEL;
+    glyph.tw = w * TEXEL;
+    glyph.th = h * TEXEL;
+    glyph.visible = true;
+
+    return true;
+}
+
+FontMetrics::FontMetrics(GlyphRasterizer* aRasterizer, int aUpscale)
+    : rasterizer(aRasterizer)
+    , upscale(aUpscale)
+    , scratchMax(256*256)
+{
+    memset(advances, 0, sizeof(advances));
+    memset(loaded, 0, sizeof(loaded));
+    scratch = new unsigned char[scratchMax];
+}
+
+FontMetrics::~FontMetrics()
+{
+    delete[] scratch;
+    delete rasterizer;
+}
+
+float FontMetrics::measure(const char* text)
+{
+    float penX = 0.f;
+    float width = 0.f;
+    for (const char* c = text; *c != '\0'; c++)
+    {
+        unsigned char ch = (unsigned char)*c;
+        if (ch == '\n') 
+        {
+            penX = 0.f;
+            continue;
+        }
+        penX += getAdvance(ch);
+        width = maxOf(width, penX);
+    }
+    return width;
+}
+
+// Glyphs Font can't rasterize get no advance there either
+float FontMetrics::getAdvance(unsigned char ch)
+{
+    if (!loaded[ch]) 
+    {
+        GlyphMetrics m;
+        memset(&m, 0, sizeof(m));
+        if (rasterizer->rasterize(ch, scratch, scratchMax, m)) {
+            advances[ch] = (float)m.advance / upscale;
+        }
+        loaded[ch] = true;
+    }
+    return advances[ch];
+}
@@ -0,0 +1,170 @@
+﻿#pragma once
+
+// Glyph atlas and text layout, independent of the platform. The platform
+// layer supplies a rasterizer and uploads the atlas page when it's dirty.
+
+struct GlyphMetrics
+{
+    int w;
+    int h;
+    int originX;    // left edge of the bitmap relative to the pen
+    int originY;    // top edge of the bitmap above the baseline
+    int advance;
+};
+
+class GlyphRasterizer
+{
+public:
+    virtual ~GlyphRasterizer()
+    {
+    }
+
+    virtual int getAscent() = 0;
+    virtual int getLineHeight() = 0;
+
+    // Writes w*h bytes of 0..255 coverage, top row first. Returns false 
+    // if the glyph is missing or bigger than coverageMax bytes.
+    virtual bool rasterize(unsigned int codepoint, 
+                           unsigned char* coverage, int coverageMax, 
+                           GlyphMetrics& metrics) = 0;
+};
+
+// Same order as Sys_Render takes them
+struct TextQuad
+{
+    float x, y, w, h;
+    float tx, ty, tw, th;
+};
+
+// A single RGBA page shared by all fonts of one kind, glyphs are stored
+// as white with coverage (or distance) in alpha, so the vertex tint colors them
+class FontAtlas
+{
+public:
+    static const int PAGE_SIZE = 1024;
+
+    explicit FontAtlas(bool aSdf);
+    ~FontAtlas();
+
+    bool isSdf() const { return sdf; }
+
+    // Reserves a w*h area on the page, false when the page is full
+    bool allocate(int w, int h, int& x, int& y);
+    void write(int x, int y, int w, int h, const unsigned char* alpha);
+
+    // Throws every glyph away, anything cached against an older 
+    // generation must be rebuilt
+    void reset();
+    int getGeneration() const { return generation; }
+
+    // Rows that changed since the last upload
+    bool getDirtyRows(int& y0, int& y1) const;
+    void clearDirty();
+    const unsigned char* getPixels() const { return pixels; }
+
+    int hTexture;
+
+private:
+    FontAtlas(const FontAtlas&);
+    FontAtlas& operator=(const FontAtlas&);
+
+    bool sdf;
+    unsigned char* pixels;
+    int generation;
+
+    int shelfX;
+    int shelfY;
+    int shelfH;
+
+    int dirtyY0;
+    int dirtyY1;
+};
+
+class Font
+{
+public:
+    // Takes ownership of the rasterizer. SDF fonts expect it to render 
+    // upscale times bigger than the font's pixel size.
+    Font(GlyphRasterizer* aRasterizer, FontAtlas* aAtlas, int aUpscale);
+    ~Font();
+
+    FontAtlas* getAtlas() const { return atlas; }
+
+    // Quads of the whole string relative to its top-left corner, in the
+    // font's pixel size. Repeated strings come straight from a cache.
+    const TextQuad* layout(const char* text, int& quadsLen);
+    float measure(const char* text);
+
+private:
+    Font(const Font&);
+    Font& operator=(const Font&);
+
+    struct Glyph
+    {
+        float x, y, w, h;
+        float tx, ty, tw, th;
+        float advance;
+        int generation;
+        bool visible;
+    };
+
+    struct Run
+    {
+        char* text;
+        unsigned int hash;
+        TextQuad* quads;
+        int quadsLen;
+        float width;
+        int generation;
+    };
+
+    const Glyph& getGlyph(unsigned char ch);
+    bool loadGlyph(unsigned char ch, Glyph& glyph);
+    Run* buildRun(const char* text, unsigned int hash, Run& run);
+
+    static const int GLYPHS_LEN = 256;
+    static const int RUNS_LEN = 512;
+    static const int SDF_SPREAD = 4;
+
+    GlyphRasterizer* rasterizer;
+    FontAtlas* atlas;
+    int upscale;
+    float ascent;
+    float lineHeight;
+
+    Glyph glyphs[GLYPHS_LEN];
+    Run runs[RUNS_LEN];
+
+    unsigned char* scratch;
+    unsigned char* field;
+    int scratchMax;
+};
+
+// Just the advances of a font's glyphs, measuring text like Font does 
+// without an atlas, for threads that don't draw it
+class FontMetrics
+{
+public:
+    // Takes ownership of the rasterizer, which renders upscale times 
+    // bigger than the font's pixel size like the Font's
+    FontMetrics(GlyphRasterizer* aRasterizer, int aUpscale);
+    ~FontMetrics();
+
+    float measure(const char* text);
+
+private:
+    FontMetrics(const FontMetrics&);
+    FontMetrics& operator=(const FontMetrics&);
+
+    float getAdvance(unsigned char ch);
+
+    static const int GLYPHS_LEN = 256;
+
+    GlyphRasterizer* rasterizer;
+    int upscale;
+    float advances[GLYPHS_LEN];
+    bool loaded[GLYPHS_LEN];
+
+    unsigned char* scratch;
+    int scratchMax;
+};
@@ -1,7 +1,9 @@
 ﻿#include "system.h"
 #include "game.h"
+#include "procgen.h"
 
 static const int NULL_PTR = 0;
+static const char PROCGEN_CACHE_DIR[] = "cache";
 
 struct GameAPI
 {
@@ -9,6 +11,7 @@ public:
     GameAPI()
         : r(0.f), g(0.f), b(0.f)
         , rd(0.001f), gd(0.005f), bd(0.0025f)
+        , prevR(0.f), prevG(0.f), prevB(0.f)
         , finished(false), askCount(0)
         , sys(NULL_PTR)
     {
@@ -27,18 +30,14 @@ public:
 
         byte* bitmap = new byte[WIDTH*HEIGHT*4];
 
-        for (int y=0; y<HEIGHT; y++) {
-            for (int x=0; x<WIDTH; x++) 
-            {
-                int pos = (y*WIDTH+x)*4;
-                bitmap[pos+0] = (x+y)/2;
-                bitmap[pos+1] = (x+y)/2;
-                bitmap[pos+2] = (x+y)/2;
-                bitmap[pos+3] = 255;
-            }
-        }
+        // Diagonal ramp, from the cache after the first run
+        ProcGenParams params;
+        ProcGen_InitParams(&params, PROCGEN_GRADIENT, WIDTH, HEIGHT);
+        params.y1 = 1.f;
+        ProcGen_GenerateCached(&params, bitmap, PROCGEN_CACHE_DIR);
 
-        Sys_LoadTexture(sys, bitmap, WIDTH, HEIGHT);
+        // A grey ramp, one byte per texel on the GPU is enough
+        Sys_LoadTextureEx(sys, bitmap, WIDTH, HEIGHT, TEXTURE_R8);
 
         delete[] bitmap;
     }
@@ -54,6 +53,9 @@ public:
         if (b > 1.0f || b < 0.f) {
             bd = -bd;
         }
+        prevR = r;
+        prevG = g;
+        prevB = b;
         r += rd;
         g += gd;
         b += bd;
@@ -79,12 +81,21 @@ public:
             return;
         }
 
-        Sys_ClearScreen(sys, r, g, b);
+        // Frames come faster than updates on high refresh displays
+        float t = Sys_GetInterpolation(sys);
+        float rr = prevR + (r - prevR) * t;
+        float gg = prevG + (g - prevG) * t;
+        float bb = prevB + (b - prevB) * t;
+
+        Sys_ClearScreen(sys, rr, gg, bb);
         Sys_SetTexture(sys, 0);
-        float baseX = r * width;
-        float baseY = g * height;
+        float baseX = rr * width;
+        float baseY = gg * height;
+        // Later quads are on top, the depth pass draws them first and skips
+        // what they cover in the ones below
         for (int i=0; i<10; i++) {
-            Sys_Render(sys, baseX+i*10.f, baseY+i*10.f, 50.f, 50.f, 0.f, 0.f, 1.f, 1.f);
+            float depth = (10-i) * 0.05f;
+            Sys_RenderDepth(sys, baseX+i*10.f, baseY+i*10.f, 50.f, 50.f, 0.f, 0.f, 1.f, 1.f, depth, 1);
         }
     }
 
@@ -116,6 +127,11 @@ private:
     float gd;
     float bd;
 
+    // Values before the last update, to render in between
+    float prevR;
+    float prevG;
+    float prevB;
+
     bool finished;
     int askCount;
 
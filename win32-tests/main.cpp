@@ -3,10 +3,18 @@
 #include <gl/GL.h>
 
 #include <math.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "system.h"
 #include "game.h"
+#include "cmdqueue.h"
+#include "font.h"
+#include "texformat.h"
+#include "tilemap.h"
+#include "trace.h"
 
 // TODO: add support for multiple monitors
 // * check if maximizing works on both monitors correctly
@@ -40,10 +48,16 @@ int getDisplayRefreshRate(HWND window)
     DEVMODE devMode;
     devMode.dmSize = sizeof(devMode);
     devMode.dmDriverExtra = 0;
-    EnumDisplaySettings(minfo.szDevice, ENUM_CURRENT_SETTINGS, &devMode);
+    if (!EnumDisplaySettings(minfo.szDevice, ENUM_CURRENT_SETTINGS, &devMode)) {
+        return 60;
+    }
 
+    // 0 and 1 stand for the hardware's default rate
     int result = (int)devMode.dmDisplayFrequency;
-    clamp(result, 30, 120);
+    if (result <= 1) {
+        result = 60;
+    }
+    clamp(result, 30, 500);
 
     return result;
 }
@@ -91,6 +105,34 @@ int getPixelFormatId(const HDC& dc)
     return 0;
 }
 
+// Finds "name value" on the command line, the value may be quoted
+bool getCmdArg(const char* cmdLine, const char* name, char* value, int valueMax)
+{
+    const char* pos = strstr(cmdLine, name);
+    if (pos == NULL) {
+        return false;
+    }
+
+    pos += strlen(name);
+    while (*pos == ' ') {
+        pos++;
+    }
+
+    char end = ' ';
+    if (*pos == '"') {
+        end = '"';
+        pos++;
+    }
+
+    int len = 0;
+    while (*pos != '\0' && *pos != end && len < valueMax-1) {
+        value[len++] = *pos++;
+    }
+    value[len] = '\0';
+
+    return len > 0;
+}
+
 class HighResTimer
 {
 public:
@@ -132,52 +174,467 @@ const unsigned char DEFAULT_VERTEX_SHADER[] = {
     0x63, 0x32, 0x20, 0x76, 0x65, 0x72, 0x74, 0x65, 0x78, 0x50, 0x6F, 0x73, 0x69, 0x74, 0x69, 0x6F, 
     0x6E, 0x5F, 0x6D, 0x6F, 0x64, 0x65, 0x6C, 0x73, 0x70, 0x61, 0x63, 0x65, 0x3B, 0x0D, 0x0A, 0x61, 
     0x74, 0x74, 0x72, 0x69, 0x62, 0x75, 0x74, 0x65, 0x20, 0x76, 0x65, 0x63, 0x32, 0x20, 0x76, 0x65, 
-    0x72, 0x74, 0x65, 0x78, 0x55, 0x76, 0x3B, 0x0D, 0x0A, 0x0D, 0x0A, 0x76, 0x61, 0x72, 0x79, 0x69, 
-    0x6E, 0x67, 0x20, 0x76, 0x65, 0x63, 0x32, 0x20, 0x76, 0x55, 0x76, 0x3B, 0x0D, 0x0A, 0x0D, 0x0A, 
-    0x75, 0x6E, 0x69, 0x66, 0x6F, 0x72, 0x6D, 0x20, 0x6D, 0x61, 0x74, 0x34, 0x20, 0x4D, 0x56, 0x50, 
-    0x3B, 0x0D, 0x0A, 0x0D, 0x0A, 0x76, 0x6F, 0x69, 0x64, 0x20, 0x6D, 0x61, 0x69, 0x6E, 0x28, 0x29, 
-    0x0D, 0x0A, 0x7B, 0x0D, 0x0A, 0x20, 0x20, 0x20, 0x20, 0x67, 0x6C, 0x5F, 0x50, 0x6F, 0x73, 0x69, 
-    0x74, 0x69, 0x6F, 0x6E, 0x20, 0x3D, 0x20, 0x20, 0x4D, 0x56, 0x50, 0x20, 0x2A, 0x20, 0x76, 0x65, 
-    0x63, 0x34, 0x28, 0x76, 0x65, 0x72, 0x74, 0x65, 0x78, 0x50, 0x6F, 0x73, 0x69, 0x74, 0x69, 0x6F, 
-    0x6E, 0x5F, 0x6D, 0x6F, 0x64, 0x65, 0x6C, 0x73, 0x70, 0x61, 0x63, 0x65, 0x2C, 0x20, 0x30, 0x2C, 
-    0x20, 0x31, 0x29, 0x3B, 0x0D, 0x0A, 0x20, 0x20, 0x20, 0x20, 0x76, 0x55, 0x76, 0x20, 0x3D, 0x20, 
-    0x76, 0x65, 0x72, 0x74, 0x65, 0x78, 0x55, 0x76, 0x3B, 0x0D, 0x0A, 0x7D, 0x0D, 0x0A, 0x00, 
+    0x72, 0x74, 0x65, 0x78, 0x55, 0x76, 0x3B, 0x0D, 0x0A, 0x61, 0x74, 0x74, 0x72, 0x69, 0x62, 0x75, 
+    0x74, 0x65, 0x20, 0x76, 0x65, 0x63, 0x34, 0x20, 0x76, 0x65, 0x72, 0x74, 0x65, 0x78, 0x43, 0x6F, 
+    0x6C, 0x6F, 0x72, 0x3B, 0x0D, 0x0A, 0x0D, 0x0A, 0x76, 0x61, 0x72, 0x79, 0x69, 0x6E, 0x67, 0x20, 
+    0x76, 0x65, 0x63, 0x32, 0x20, 0x76, 0x55, 0x76, 0x3B, 0x0D, 0x0A, 0x76, 0x61, 0x72, 0x79, 0x69, 
+    0x6E, 0x67, 0x20, 0x76, 0x65, 0x63, 0x34, 0x20, 0x76, 0x43, 0x6F, 0x6C, 0x6F, 0x72, 0x3B, 0x0D, 
+    0x0A, 0x0D, 0x0A, 0x75, 0x6E, 0x69, 0x66, 0x6F, 0x72, 0x6D, 0x20, 0x6D, 0x61, 0x74, 0x34, 0x20, 
+    0x4D, 0x56, 0x50, 0x3B, 0x0D, 0x0A, 0x0D, 0x0A, 0x76, 0x6F, 0x69, 0x64, 0x20, 0x6D, 0x61, 0x69, 
+    0x6E, 0x28, 0x29, 0x0D, 0x0A, 0x7B, 0x0D, 0x0A, 0x20, 0x20, 0x20, 0x20, 0x67, 0x6C, 0x5F, 0x50, 
+    0x6F, 0x73, 0x69, 0x74, 0x69, 0x6F, 0x6E, 0x20, 0x3D, 0x20, 0x20, 0x4D, 0x56, 0x50, 0x20, 0x2A, 
+    0x20, 0x76, 0x65, 0x63, 0x34, 0x28, 0x76, 0x65, 0x72, 0x74, 0x65, 0x78, 0x50, 0x6F, 0x73, 0x69, 
+    0x74, 0x69, 0x6F, 0x6E, 0x5F, 0x6D, 0x6F, 0x64, 0x65, 0x6C, 0x73, 0x70, 0x61, 0x63, 0x65, 0x2C, 
+    0x20, 0x30, 0x2C, 0x20, 0x31, 0x29, 0x3B, 0x0D, 0x0A, 0x20, 0x20, 0x20, 0x20, 0x76, 0x55, 0x76, 
+    0x20, 0x3D, 0x20, 0x76, 0x65, 0x72, 0x74, 0x65, 0x78, 0x55, 0x76, 0x3B, 0x0D, 0x0A, 0x20, 0x20, 
+    0x20, 0x20, 0x76, 0x43, 0x6F, 0x6C, 0x6F, 0x72, 0x20, 0x3D, 0x20, 0x76, 0x65, 0x72, 0x74, 0x65, 
+    0x78, 0x43, 0x6F, 0x6C, 0x6F, 0x72, 0x3B, 0x0D, 0x0A, 0x7D, 0x0D, 0x0A, 0x00, 
+};
+
+const unsigned char SPRITE_VERTEX_SHADER[] = {
+    0x23, 0x76, 0x65, 0x72, 0x73, 0x69, 0x6F, 0x6E, 0x20, 0x31, 0x32, 0x30, 0x0D, 0x0A, 0x0D, 0x0A, 
+    0x2F, 0x2F, 0x20, 0x53, 0x70, 0x72, 0x69, 0x74, 0x65, 0x73, 0x20, 0x61, 0x72, 0x65, 0x20, 0x70, 
+    0x6C, 0x61, 0x63, 0x65, 0x64, 0x20, 0x61, 0x72, 0x6F, 0x75, 0x6E, 0x64, 0x20, 0x61, 0x20, 0x70, 
+    0x69, 0x76, 0x6F, 0x74, 0x20, 0x61, 0x6E, 0x64, 0x20, 0x72, 0x6F, 0x74, 0x61, 0x74, 0x65, 0x64, 
+    0x20, 0x68, 0x65, 0x72, 0x65, 0x20, 0x69, 0x6E, 0x73, 0x74, 0x65, 0x61, 0x64, 0x20, 0x6F, 0x66, 
+    0x20, 0x6F, 0x6E, 0x20, 0x74, 0x68, 0x65, 0x20, 0x0D, 0x0A, 0x2F, 0x2F, 0x20, 0x43, 0x50, 0x55, 
+    0x2C, 0x20, 0x74, 0x68, 0x65, 0x69, 0x72, 0x20, 0x73, 0x63, 0x61, 0x6C, 0x65, 0x20, 0x69, 0x73, 
+    0x20, 0x61, 0x6C, 0x72, 0x65, 0x61, 0x64, 0x79, 0x20, 0x69, 0x6E, 0x20, 0x74, 0x68, 0x65, 0x20, 
+    0x6F, 0x66, 0x66, 0x73, 0x65, 0x74, 0x2E, 0x20, 0x50, 0x6C, 0x61, 0x69, 0x6E, 0x20, 0x71, 0x75, 
+    0x61, 0x64, 0x73, 0x20, 0x63, 0x6F, 0x6D, 0x65, 0x20, 0x77, 0x69, 0x74, 0x68, 0x20, 0x6E, 0x6F, 
+    0x20, 0x0D, 0x0A, 0x2F, 0x2F, 0x20, 0x6F, 0x66, 0x66, 0x73, 0x65, 0x74, 0x20, 0x61, 0x6E, 0x64, 
+    0x20, 0x6E, 0x6F, 0x20, 0x72, 0x6F, 0x74, 0x61, 0x74, 0x69, 0x6F, 0x6E, 0x2E, 0x0D, 0x0A, 0x61, 
+    0x74, 0x74, 0x72, 0x69, 0x62, 0x75, 0x74, 0x65, 0x20, 0x76, 0x65, 0x63, 0x32, 0x20, 0x76, 0x65, 
+    0x72, 0x74, 0x65, 0x78, 0x50, 0x6F, 0x73, 0x69, 0x74, 0x69, 0x6F, 0x6E, 0x5F, 0x6D, 0x6F, 0x64, 
+    0x65, 0x6C, 0x73, 0x70, 0x61, 0x63, 0x65, 0x3B, 0x0D, 0x0A, 0x61, 0x74, 0x74, 0x72, 0x69, 0x62, 
+    0x75, 0x74, 0x65, 0x20, 0x76, 0x65, 0x63, 0x32, 0x20, 0x76, 0x65, 0x72, 0x74, 0x65, 0x78, 0x55, 
+    0x76, 0x3B, 0x0D, 0x0A, 0x61, 0x74, 0x74, 0x72, 0x69, 0x62, 0x75, 0x74, 0x65, 0x20, 0x76, 0x65, 
+    0x63, 0x34, 0x20, 0x76, 0x65, 0x72, 0x74, 0x65, 0x78, 0x43, 0x6F, 0x6C, 0x6F, 0x72, 0x3B, 0x0D, 
+    0x0A, 0x61, 0x74, 0x74, 0x72, 0x69, 0x62, 0x75, 0x74, 0x65, 0x20, 0x76, 0x65, 0x63, 0x32, 0x20, 
+    0x76, 0x65, 0x72, 0x74, 0x65, 0x78, 0x4F, 0x66, 0x66, 0x73, 0x65, 0x74, 0x3B, 0x0D, 0x0A, 0x61, 
+    0x74, 0x74, 0x72, 0x69, 0x62, 0x75, 0x74, 0x65, 0x20, 0x76, 0x65, 0x63, 0x32, 0x20, 0x76, 0x65, 
+    0x72, 0x74, 0x65, 0x78, 0x54, 0x72, 0x61, 0x6E, 0x73, 0x66, 0x6F, 0x72, 0x6D, 0x3B, 0x0D, 0x0A, 
+    0x0D, 0x0A, 0x76, 0x61, 0x72, 0x79, 0x69, 0x6E, 0x67, 0x20, 0x76, 0x65, 0x63, 0x32, 0x20, 0x76, 
+    0x55, 0x76, 0x3B, 0x0D, 0x0A, 0x76, 0x61, 0x72, 0x79, 0x69, 0x6E, 0x67, 0x20, 0x76, 0x65, 0x63, 
+    0x34, 0x20, 0x76, 0x43, 0x6F, 0x6C, 0x6F, 0x72, 0x3B, 0x0D, 0x0A, 0x0D, 0x0A, 0x75, 0x6E, 0x69, 
+    0x66, 0x6F, 0x72, 0x6D, 0x20, 0x6D, 0x61, 0x74, 0x34, 0x20, 0x4D, 0x56, 0x50, 0x3B, 0x0D, 0x0A, 
+    0x0D, 0x0A, 0x76, 0x6F, 0x69, 0x64, 0x20, 0x6D, 0x61, 0x69, 0x6E, 0x28, 0x29, 0x0D, 0x0A, 0x7B, 
+    0x0D, 0x0A, 0x20, 0x20, 0x20, 0x20, 0x2F, 0x2F, 0x20, 0x50, 0x69, 0x76, 0x6F, 0x74, 0x20, 0x61, 
+    0x6E, 0x64, 0x20, 0x6F, 0x66, 0x66, 0x73, 0x65, 0x74, 0x20, 0x61, 0x72, 0x65, 0x20, 0x69, 0x6E, 
+    0x20, 0x71, 0x75, 0x61, 0x72, 0x74, 0x65, 0x72, 0x20, 0x70, 0x69, 0x78, 0x65, 0x6C, 0x73, 0x2C, 
+    0x20, 0x72, 0x6F, 0x74, 0x61, 0x74, 0x69, 0x6F, 0x6E, 0x20, 0x69, 0x6E, 0x20, 0x31, 0x2F, 0x33, 
+    0x32, 0x37, 0x36, 0x37, 0x20, 0x6F, 0x66, 0x20, 0x61, 0x20, 0x0D, 0x0A, 0x20, 0x20, 0x20, 0x20, 
+    0x2F, 0x2F, 0x20, 0x68, 0x61, 0x6C, 0x66, 0x20, 0x74, 0x75, 0x72, 0x6E, 0x2C, 0x20, 0x64, 0x65, 
+    0x70, 0x74, 0x68, 0x20, 0x66, 0x72, 0x6F, 0x6D, 0x20, 0x30, 0x20, 0x74, 0x6F, 0x20, 0x33, 0x32, 
+    0x37, 0x36, 0x37, 0x0D, 0x0A, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6C, 0x6F, 0x61, 0x74, 0x20, 0x61, 
+    0x6E, 0x67, 0x6C, 0x65, 0x20, 0x3D, 0x20, 0x76, 0x65, 0x72, 0x74, 0x65, 0x78, 0x54, 0x72, 0x61, 
+    0x6E, 0x73, 0x66, 0x6F, 0x72, 0x6D, 0x2E, 0x78, 0x20, 0x2A, 0x20, 0x28, 0x33, 0x2E, 0x31, 0x34, 
+    0x31, 0x35, 0x39, 0x32, 0x36, 0x35, 0x20, 0x2F, 0x20, 0x33, 0x32, 0x37, 0x36, 0x37, 0x2E, 0x30, 
+    0x29, 0x3B, 0x0D, 0x0A, 0x20, 0x20, 0x20, 0x20, 0x76, 0x65, 0x63, 0x32, 0x20, 0x6F, 0x66, 0x66, 
+    0x73, 0x65, 0x74, 0x20, 0x3D, 0x20, 0x76, 0x65, 0x72, 0x74, 0x65, 0x78, 0x4F, 0x66, 0x66, 0x73, 
+    0x65, 0x74, 0x3B, 0x0D, 0x0A, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6C, 0x6F, 0x61, 0x74, 0x20, 0x63, 
+    0x20, 0x3D, 0x20, 0x63, 0x6F, 0x73, 0x28, 0x61, 0x6E, 0x67, 0x6C, 0x65, 0x29, 0x3B, 0x0D, 0x0A, 
+    0x20, 0x20, 0x20, 0x20, 0x66, 0x6C, 0x6F, 0x61, 0x74, 0x20, 0x73, 0x20, 0x3D, 0x20, 0x73, 0x69, 
+    0x6E, 0x28, 0x61, 0x6E, 0x67, 0x6C, 0x65, 0x29, 0x3B, 0x0D, 0x0A, 0x20, 0x20, 0x20, 0x20, 0x76, 
+    0x65, 0x63, 0x32, 0x20, 0x70, 0x6F, 0x73, 0x20, 0x3D, 0x20, 0x76, 0x65, 0x72, 0x74, 0x65, 0x78, 
+    0x50, 0x6F, 0x73, 0x69, 0x74, 0x69, 0x6F, 0x6E, 0x5F, 0x6D, 0x6F, 0x64, 0x65, 0x6C, 0x73, 0x70, 
+    0x61, 0x63, 0x65, 0x20, 0x2B, 0x20, 0x76, 0x65, 0x63, 0x32, 0x28, 0x63, 0x2A, 0x6F, 0x66, 0x66, 
+    0x73, 0x65, 0x74, 0x2E, 0x78, 0x20, 0x2D, 0x20, 0x73, 0x2A, 0x6F, 0x66, 0x66, 0x73, 0x65, 0x74, 
+    0x2E, 0x79, 0x2C, 0x20, 0x73, 0x2A, 0x6F, 0x66, 0x66, 0x73, 0x65, 0x74, 0x2E, 0x78, 0x20, 0x2B, 
+    0x20, 0x63, 0x2A, 0x6F, 0x66, 0x66, 0x73, 0x65, 0x74, 0x2E, 0x79, 0x29, 0x3B, 0x0D, 0x0A, 0x0D, 
+    0x0A, 0x20, 0x20, 0x20, 0x20, 0x67, 0x6C, 0x5F, 0x50, 0x6F, 0x73, 0x69, 0x74, 0x69, 0x6F, 0x6E, 
+    0x20, 0x3D, 0x20, 0x20, 0x4D, 0x56, 0x50, 0x20, 0x2A, 0x20, 0x76, 0x65, 0x63, 0x34, 0x28, 0x70, 
+    0x6F, 0x73, 0x2C, 0x20, 0x30, 0x2C, 0x20, 0x31, 0x29, 0x3B, 0x0D, 0x0A, 0x20, 0x20, 0x20, 0x20, 
+    0x67, 0x6C, 0x5F, 0x50, 0x6F, 0x73, 0x69, 0x74, 0x69, 0x6F, 0x6E, 0x2E, 0x7A, 0x20, 0x3D, 0x20, 
+    0x76, 0x65, 0x72, 0x74, 0x65, 0x78, 0x54, 0x72, 0x61, 0x6E, 0x73, 0x66, 0x6F, 0x72, 0x6D, 0x2E, 
+    0x79, 0x20, 0x2A, 0x20, 0x28, 0x32, 0x2E, 0x30, 0x20, 0x2F, 0x20, 0x33, 0x32, 0x37, 0x36, 0x37, 
+    0x2E, 0x30, 0x29, 0x20, 0x2D, 0x20, 0x31, 0x2E, 0x30, 0x3B, 0x0D, 0x0A, 0x20, 0x20, 0x20, 0x20, 
+    0x76, 0x55, 0x76, 0x20, 0x3D, 0x20, 0x76, 0x65, 0x72, 0x74, 0x65, 0x78, 0x55, 0x76, 0x3B, 0x0D, 
+    0x0A, 0x20, 0x20, 0x20, 0x20, 0x76, 0x43, 0x6F, 0x6C, 0x6F, 0x72, 0x20, 0x3D, 0x20, 0x76, 0x65, 
+    0x72, 0x74, 0x65, 0x78, 0x43, 0x6F, 0x6C, 0x6F, 0x72, 0x3B, 0x0D, 0x0A, 0x7D, 0x0D, 0x0A, 0x00, 
 };
 
 const unsigned char DEFAULT_FRAG_SHADER[] = {
     0x23, 0x76, 0x65, 0x72, 0x73, 0x69, 0x6F, 0x6E, 0x20, 0x31, 0x32, 0x30, 0x0D, 0x0A, 0x0D, 0x0A, 
     0x76, 0x61, 0x72, 0x79, 0x69, 0x6E, 0x67, 0x20, 0x76, 0x65, 0x63, 0x32, 0x20, 0x76, 0x55, 0x76, 
-    0x3B, 0x0D, 0x0A, 0x0D, 0x0A, 0x75, 0x6E, 0x69, 0x66, 0x6F, 0x72, 0x6D, 0x20, 0x73, 0x61, 0x6D, 
-    0x70, 0x6C, 0x65, 0x72, 0x32, 0x44, 0x20, 0x73, 0x61, 0x6D, 0x70, 0x6C, 0x65, 0x72, 0x3B, 0x0D, 
-    0x0A, 0x0D, 0x0A, 0x76, 0x6F, 0x69, 0x64, 0x20, 0x6D, 0x61, 0x69, 0x6E, 0x28, 0x29, 0x0D, 0x0A, 
-    0x7B, 0x0D, 0x0A, 0x20, 0x20, 0x20, 0x20, 0x67, 0x6C, 0x5F, 0x46, 0x72, 0x61, 0x67, 0x43, 0x6F, 
-    0x6C, 0x6F, 0x72, 0x20, 0x3D, 0x20, 0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 0x65, 0x32, 0x44, 0x28, 
-    0x73, 0x61, 0x6D, 0x70, 0x6C, 0x65, 0x72, 0x2C, 0x20, 0x76, 0x55, 0x76, 0x29, 0x3B, 0x2F, 0x2F, 
-    0x20, 0x2A, 0x20, 0x30, 0x2E, 0x38, 0x20, 0x2B, 0x20, 0x76, 0x65, 0x63, 0x34, 0x28, 0x30, 0x2E, 
-    0x38, 0x38, 0x2C, 0x20, 0x30, 0x2E, 0x36, 0x36, 0x2C, 0x20, 0x30, 0x2E, 0x36, 0x35, 0x2C, 0x20, 
-    0x31, 0x2E, 0x30, 0x29, 0x20, 0x2A, 0x20, 0x30, 0x2E, 0x32, 0x3B, 0x0D, 0x0A, 0x7D, 0x0D, 0x0A, 
-    0x00, 
+    0x3B, 0x0D, 0x0A, 0x76, 0x61, 0x72, 0x79, 0x69, 0x6E, 0x67, 0x20, 0x76, 0x65, 0x63, 0x34, 0x20, 
+    0x76, 0x43, 0x6F, 0x6C, 0x6F, 0x72, 0x3B, 0x0D, 0x0A, 0x0D, 0x0A, 0x75, 0x6E, 0x69, 0x66, 0x6F, 
+    0x72, 0x6D, 0x20, 0x73, 0x61, 0x6D, 0x70, 0x6C, 0x65, 0x72, 0x32, 0x44, 0x20, 0x73, 0x61, 0x6D, 
+    0x70, 0x6C, 0x65, 0x72, 0x3B, 0x0D, 0x0A, 0x0D, 0x0A, 0x76, 0x6F, 0x69, 0x64, 0x20, 0x6D, 0x61, 
+    0x69, 0x6E, 0x28, 0x29, 0x0D, 0x0A, 0x7B, 0x0D, 0x0A, 0x20, 0x20, 0x20, 0x20, 0x67, 0x6C, 0x5F, 
+    0x46, 0x72, 0x61, 0x67, 0x43, 0x6F, 0x6C, 0x6F, 0x72, 0x20, 0x3D, 0x20, 0x74, 0x65, 0x78, 0x74, 
+    0x75, 0x72, 0x65, 0x32, 0x44, 0x28, 0x73, 0x61, 0x6D, 0x70, 0x6C, 0x65, 0x72, 0x2C, 0x20, 0x76, 
+    0x55, 0x76, 0x29, 0x20, 0x2A, 0x20, 0x76, 0x43, 0x6F, 0x6C, 0x6F, 0x72, 0x3B, 0x0D, 0x0A, 0x7D, 
+    0x0D, 0x0A, 0x00, 
+};
+
+const unsigned char SDF_FRAG_SHADER[] = {
+    0x23, 0x76, 0x65, 0x72, 0x73, 0x69, 0x6F, 0x6E, 0x20, 0x31, 0x32, 0x30, 0x0D, 0x0A, 0x0D, 0x0A, 
+    0x76, 0x61, 0x72, 0x79, 0x69, 0x6E, 0x67, 0x20, 0x76, 0x65, 0x63, 0x32, 0x20, 0x76, 0x55, 0x76, 
+    0x3B, 0x0D, 0x0A, 0x76, 0x61, 0x72, 0x79, 0x69, 0x6E, 0x67, 0x20, 0x76, 0x65, 0x63, 0x34, 0x20, 
+    0x76, 0x43, 0x6F, 0x6C, 0x6F, 0x72, 0x3B, 0x0D, 0x0A, 0x0D, 0x0A, 0x75, 0x6E, 0x69, 0x66, 0x6F, 
+    0x72, 0x6D, 0x20, 0x73, 0x61, 0x6D, 0x70, 0x6C, 0x65, 0x72, 0x32, 0x44, 0x20, 0x73, 0x61, 0x6D, 
+    0x70, 0x6C, 0x65, 0x72, 0x3B, 0x0D, 0x0A, 0x0D, 0x0A, 0x76, 0x6F, 0x69, 0x64, 0x20, 0x6D, 0x61, 
+    0x69, 0x6E, 0x28, 0x29, 0x0D, 0x0A, 0x7B, 0x0D, 0x0A, 0x20, 0x20, 0x20, 0x20, 0x2F, 0x2F, 0x20, 
+    0x44, 0x69, 0x73, 0x74, 0x61, 0x6E, 0x63, 0x65, 0x20, 0x66, 0x69, 0x65, 0x6C, 0x64, 0x3A, 0x20, 
+    0x30, 0x2E, 0x35, 0x20, 0x69, 0x73, 0x20, 0x74, 0x68, 0x65, 0x20, 0x67, 0x6C, 0x79, 0x70, 0x68, 
+    0x20, 0x65, 0x64, 0x67, 0x65, 0x2C, 0x20, 0x73, 0x6D, 0x6F, 0x6F, 0x74, 0x68, 0x20, 0x69, 0x74, 
+    0x20, 0x6F, 0x76, 0x65, 0x72, 0x20, 0x61, 0x62, 0x6F, 0x75, 0x74, 0x20, 0x61, 0x20, 0x70, 0x69, 
+    0x78, 0x65, 0x6C, 0x0D, 0x0A, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6C, 0x6F, 0x61, 0x74, 0x20, 0x64, 
+    0x69, 0x73, 0x74, 0x20, 0x3D, 0x20, 0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 0x65, 0x32, 0x44, 0x28, 
+    0x73, 0x61, 0x6D, 0x70, 0x6C, 0x65, 0x72, 0x2C, 0x20, 0x76, 0x55, 0x76, 0x29, 0x2E, 0x61, 0x3B, 
+    0x0D, 0x0A, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6C, 0x6F, 0x61, 0x74, 0x20, 0x77, 0x69, 0x64, 0x74, 
+    0x68, 0x20, 0x3D, 0x20, 0x66, 0x77, 0x69, 0x64, 0x74, 0x68, 0x28, 0x64, 0x69, 0x73, 0x74, 0x29, 
+    0x20, 0x2A, 0x20, 0x30, 0x2E, 0x37, 0x3B, 0x0D, 0x0A, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6C, 0x6F, 
+    0x61, 0x74, 0x20, 0x61, 0x6C, 0x70, 0x68, 0x61, 0x20, 0x3D, 0x20, 0x73, 0x6D, 0x6F, 0x6F, 0x74, 
+    0x68, 0x73, 0x74, 0x65, 0x70, 0x28, 0x30, 0x2E, 0x35, 0x20, 0x2D, 0x20, 0x77, 0x69, 0x64, 0x74, 
+    0x68, 0x2C, 0x20, 0x30, 0x2E, 0x35, 0x20, 0x2B, 0x20, 0x77, 0x69, 0x64, 0x74, 0x68, 0x2C, 0x20, 
+    0x64, 0x69, 0x73, 0x74, 0x29, 0x3B, 0x0D, 0x0A, 0x20, 0x20, 0x20, 0x20, 0x67, 0x6C, 0x5F, 0x46, 
+    0x72, 0x61, 0x67, 0x43, 0x6F, 0x6C, 0x6F, 0x72, 0x20, 0x3D, 0x20, 0x76, 0x65, 0x63, 0x34, 0x28, 
+    0x76, 0x43, 0x6F, 0x6C, 0x6F, 0x72, 0x2E, 0x72, 0x67, 0x62, 0x2C, 0x20, 0x76, 0x43, 0x6F, 0x6C, 
+    0x6F, 0x72, 0x2E, 0x61, 0x20, 0x2A, 0x20, 0x61, 0x6C, 0x70, 0x68, 0x61, 0x29, 0x3B, 0x0D, 0x0A, 
+    0x7D, 0x0D, 0x0A, 0x00, 
+};
+
+// Vertex layouts for the sprite batch. Attribute 0 is the position, 1 is 
+// the texture coords, 2 is the tint color. Layouts without a color leave 
+// attribute 2 disabled, so it's constant white. Layouts with GPU_TRANSFORM
+// also carry a pivot offset (3) and rotation (4) for their shader. Layouts
+// with HAS_DEPTH keep a depth for the layered pass next to the rotation,
+// the others ignore setDepth().
+
+struct VertexAttrib
+{
+    GLint size;
+    GLenum type;
+    GLboolean normalized;
+    size_t offset;
+};
+
+inline short quantizePos(float value, int subpixels)
+{
+    float scaled = value * subpixels;
+    clamp(scaled, -32768.f, 32767.f);
+    return (short)floor(scaled + 0.5f);
+}
+
+inline unsigned short quantizeUnorm16(float value)
+{
+    clamp(value, 0.f, 1.f);
+    return (unsigned short)(value * 65535.f + 0.5f);
+}
+
+inline void packColor(unsigned char* rgba, unsigned int color)
+{
+    rgba[0] = (unsigned char)(color >> 24);
+    rgba[1] = (unsigned char)(color >> 16);
+    rgba[2] = (unsigned char)(color >> 8);
+    rgba[3] = (unsigned char)(color);
+}
+
+// 16 bytes: float position and texture coords, no tint
+struct FloatVertex
+{
+    float x;
+    float y;
+    float tx;
+    float ty;
+
+    static const int POS_SUBPIXELS = 1;
+    static const int ATTRIBS_LEN = 2;
+    static const bool GPU_TRANSFORM = false;
+    static const bool HAS_DEPTH = false;
+
+    FloatVertex(): x(0.f), y(0.f), tx(0.f), ty(0.f)
+    {
+    }
+
+    FloatVertex(float aX, float aY, float aTx, float aTy, unsigned int)
+        : x(aX), y(aY), tx(aTx), ty(aTy)
+    {
+    }
+
+    void setDepth(float)
+    {
+    }
+
+    static const VertexAttrib* getAttribs()
+    {
+        static const VertexAttrib ATTRIBS[ATTRIBS_LEN] = {
+            { 2, GL_FLOAT, GL_FALSE, offsetof(FloatVertex, x) },
+            { 2, GL_FLOAT, GL_FALSE, offsetof(FloatVertex, tx) },
+        };
+        return ATTRIBS;
+    }
+};
+
+// 8 bytes: position in quarter pixels (+-8191 px range), unorm16 texture coords
+struct ShortVertex
+{
+    short x;
+    short y;
+    unsigned short tx;
+    unsigned short ty;
+
+    static const int POS_SUBPIXELS = 4;
+    static const int ATTRIBS_LEN = 2;
+    static const bool GPU_TRANSFORM = false;
+    static const bool HAS_DEPTH = false;
+
+    ShortVertex(): x(0), y(0), tx(0), ty(0)
+    {
+    }
+
+    ShortVertex(float aX, float aY, float aTx, float aTy, unsigned int)
+        : x(quantizePos(aX, POS_SUBPIXELS)), y(quantizePos(aY, POS_SUBPIXELS))
+        , tx(quantizeUnorm16(aTx)), ty(quantizeUnorm16(aTy))
+    {
+    }
+
+    void setDepth(float)
+    {
+    }
+
+    static const VertexAttrib* getAttribs()
+    {
+        static const VertexAttrib ATTRIBS[ATTRIBS_LEN] = {
+            { 2, GL_SHORT,          GL_FALSE, offsetof(ShortVertex, x) },
+            { 2, GL_UNSIGNED_SHORT, GL_TRUE,  offsetof(ShortVertex, tx) },
+        };
+        return ATTRIBS;
+    }
+};
+
+// 12 bytes: same as ShortVertex plus RGBA8 tint
+struct ShortColorVertex
+{
+    short x;
+    short y;
+    unsigned short tx;
+    unsigned short ty;
+    unsigned char rgba[4];
+
+    static const int POS_SUBPIXELS = 4;
+    static const int ATTRIBS_LEN = 3;
+    static const bool GPU_TRANSFORM = false;
+    static const bool HAS_DEPTH = false;
+
+    ShortColorVertex(): x(0), y(0), tx(0), ty(0)
+    {
+        rgba[0] = rgba[1] = rgba[2] = rgba[3] = 255;
+    }
+
+    ShortColorVertex(float aX, float aY, float aTx, float aTy, unsigned int color)
+        : x(quantizePos(aX, POS_SUBPIXELS)), y(quantizePos(aY, POS_SUBPIXELS))
+        , tx(quantizeUnorm16(aTx)), ty(quantizeUnorm16(aTy))
+    {
+        packColor(rgba, color);
+    }
+
+    void setDepth(float)
+    {
+    }
+
+    static const VertexAttrib* getAttribs()
+    {
+        static const VertexAttrib ATTRIBS[ATTRIBS_LEN] = {
+            { 2, GL_SHORT,          GL_FALSE, offsetof(ShortColorVertex, x) },
+            { 2, GL_UNSIGNED_SHORT, GL_TRUE,  offsetof(ShortColorVertex, tx) },
+            { 4, GL_UNSIGNED_BYTE,  GL_TRUE,  offsetof(ShortColorVertex, rgba) },
+        };
+        return ATTRIBS;
+    }
+};
+
+// 20 bytes: pivot and the corner's offset from it in quarter pixels 
+// (+-8191 px range each), unorm16 texture coords, RGBA8 tint, rotation 
+// in 1/32767 of a half turn and depth from 0 to 32767. Scale is applied
+// to the offset on the CPU, the vertex shader rotates it and puts the 
+// corner in place.
+struct SpriteVertex
+{
+    short x;
+    short y;
+    short ox;
+    short oy;
+    unsigned short tx;
+    unsigned short ty;
+    unsigned char rgba[4];
+    short rotation;
+    short depth;
+
+    static const int POS_SUBPIXELS = 4;
+    static const int ATTRIBS_LEN = 5;
+    static const bool GPU_TRANSFORM = true;
+    static const bool HAS_DEPTH = true;
+
+    SpriteVertex(): x(0), y(0), ox(0), oy(0), tx(0), ty(0), rotation(0), depth(0)
+    {
+        rgba[0] = rgba[1] = rgba[2] = rgba[3] = 255;
+    }
+
+    SpriteVertex(float aX, float aY, float aTx, float aTy, unsigned int color)
+        : x(quantizePos(aX, POS_SUBPIXELS)), y(quantizePos(aY, POS_SUBPIXELS)), ox(0), oy(0)
+        , tx(quantizeUnorm16(aTx)), ty(quantizeUnorm16(aTy))
+        , rotation(0), depth(0)
+    {
+        packColor(rgba, color);
+    }
+
+    SpriteVertex(float pivotX, float pivotY, float offsetX, float offsetY, 
+                 float aTx, float aTy, unsigned int color,
+                 float aRotation, float scaleX, float scaleY)
+        : x(quantizePos(pivotX, POS_SUBPIXELS)), y(quantizePos(pivotY, POS_SUBPIXELS))
+        , ox(quantizePos(offsetX*scaleX, POS_SUBPIXELS)), oy(quantizePos(offsetY*scaleY, POS_SUBPIXELS))
+        , tx(quantizeUnorm16(aTx)), ty(quantizeUnorm16(aTy))
+        , rotation(quantizeRotation(aRotation)), depth(0)
+    {
+        packColor(rgba, color);
+    }
+
+    void setDepth(float value)
+    {
+        depth = quantizePos(value, 32767);
+    }
+
+    static short quantizeRotation(float radians)
+    {
+        static const float PI = 3.14159265f;
+        float halfTurns = radians / PI;
+        halfTurns -= 2.f * floor((halfTurns + 1.f) * 0.5f);
+        return quantizePos(halfTurns, 32767);
+    }
+
+    static const VertexAttrib* getAttribs()
+    {
+        static const VertexAttrib ATTRIBS[ATTRIBS_LEN] = {
+            { 2, GL_SHORT,          GL_FALSE, offsetof(SpriteVertex, x) },
+            { 2, GL_UNSIGNED_SHORT, GL_TRUE,  offsetof(SpriteVertex, tx) },
+            { 4, GL_UNSIGNED_BYTE,  GL_TRUE,  offsetof(SpriteVertex, rgba) },
+            { 2, GL_SHORT,          GL_FALSE, offsetof(SpriteVertex, ox) },
+            { 2, GL_SHORT,          GL_FALSE, offsetof(SpriteVertex, rotation) },
+        };
+        return ATTRIBS;
+    }
+};
+
+template <class V>
+const unsigned char* getVertexShader()
+{
+    return V::GPU_TRANSFORM ? SPRITE_VERTEX_SHADER : DEFAULT_VERTEX_SHADER;
+}
+
+struct SpriteTransform
+{
+    // Where the pivot ends up on screen
+    float pivotX;
+    float pivotY;
+    float rotation;
+    float scaleX;
+    float scaleY;
+    unsigned int color;
+    // Only filled in for layouts doing the transform on the CPU
+    float cosA;
+    float sinA;
 };
 
-struct Graphics
+// Corner at (offsetX, offsetY) from the pivot, before rotation and scale
+template <class V>
+V makeTransformedVertex(const SpriteTransform& t, float offsetX, float offsetY, float tx, float ty)
+{
+    float x = offsetX * t.scaleX;
+    float y = offsetY * t.scaleY;
+    return V(t.pivotX + t.cosA*x - t.sinA*y, t.pivotY + t.sinA*x + t.cosA*y, tx, ty, t.color);
+}
+
+template <>
+SpriteVertex makeTransformedVertex<SpriteVertex>(const SpriteTransform& t, 
+                                                 float offsetX, float offsetY, float tx, float ty)
+{
+    return SpriteVertex(t.pivotX, t.pivotY, offsetX, offsetY, tx, ty, 
+                        t.color, t.rotation, t.scaleX, t.scaleY);
+}
+
+// Pick the sprite batch layout at compile time, e.g. /DSPRITE_VERTEX=ShortVertex.
+// The default costs bandwidth for features: at 120 bytes a quad, plain 
+// Sys_Render uploads a quarter more than FloatVertex did (96 bytes) and 
+// over twice ShortVertex (48 bytes), in exchange for rotating on the GPU
+// and depth tested layers. Games that draw mostly axis-aligned sprites 
+// without Sys_RenderDepth are better off with ShortColorVertex (72 bytes)
+// or ShortVertex, which transform on the CPU and sort layers by blending.
+#ifndef SPRITE_VERTEX
+#define SPRITE_VERTEX SpriteVertex
+#endif
+
+template <class Vertex>
+struct GraphicsT
 {
-    Graphics()
+    GraphicsT()
         : initialized(false)
-        , textureLen(0)
+        , texturesLen(0)
+        , residentBytes(0)
+        , textureBudget(DEFAULT_TEXTURE_BUDGET)
+        , useClock(0)
+        , frameStartUse(0)
+        , hasS3tc(false)
+        , hasSwapTear(false)
+        , swapInterval(0)
+        , activeTarget(-1)
+        , hasTimerQuery(false)
+        , gpuTimersEnabled(false)
+        , gpuTimerFrame(0)
+        , gpuTimingsValid(false)
         , activeHTexture(0)
+        , nextHTexture(0)
         , verticesLen(0)
+        , mvpSerial(0)
+        , screenWidth(1)
+        , screenHeight(1)
+        , targetWidth(1)
+        , targetHeight(1)
+        , layered(new LayeredQuad[LAYERED_MAX])
+        , layeredLen(0)
     {
+        memset(&state, 0, sizeof(state));
+        memset(&frameStats, 0, sizeof(frameStats));
+        memset(&lastFrameStats, 0, sizeof(lastFrameStats));
+        memset(gpuTimerFrames, 0, sizeof(gpuTimerFrames));
+        memset(&gpuTimings, 0, sizeof(gpuTimings));
+        memset(staticBatches, 0, sizeof(staticBatches));
     }
 
-    ~Graphics()
+    ~GraphicsT()
     {
+        delete[] layered;
+
         if (initialized == false) {
             return;
         }
 
+        setGpuTimers(false);
+
         DeleteBuffers(1, &arrayBuffer);
-        glDeleteTextures((GLsizei)textureLen, textures);
+        for (int i=0; i<texturesLen; i++) 
+        {
+            if (textures[i].id != 0) {
+                glDeleteTextures(1, &textures[i].id);
+            }
+            if (textures[i].framebuffer != 0) {
+                DeleteFramebuffers(1, &textures[i].framebuffer);
+                DeleteRenderbuffers(1, &textures[i].depthbuffer);
+            }
+            delete[] textures[i].source;
+        }
         DeleteVertexArrays(1, &vertexArray);
+
+        for (int i=0; i<STATIC_BATCHES_MAX + CHUNK_BATCHES_MAX; i++) 
+        {
+            if (isStaticBatchValid(i)) 
+            {
+                DeleteBuffers(1, &staticBatches[i].arrayBuffer);
+                DeleteVertexArrays(1, &staticBatches[i].vertexArray);
+            }
+        }
     }
 
     void init()
@@ -209,164 +666,1284 @@ struct Graphics
         DisableVertexAttribArray = (PFNGLDISABLEVERTEXATTRIBARRAYPROC)wglGetProcAddress("glDisableVertexAttribArray");
         DeleteBuffers = (PFNGLDELETEBUFFERSPROC)wglGetProcAddress("glDeleteBuffers");
         BufferSubData = (PFNGLBUFFERSUBDATAPROC)wglGetProcAddress("glBufferSubData");
+        BindAttribLocation = (PFNGLBINDATTRIBLOCATIONPROC)wglGetProcAddress("glBindAttribLocation");
+        VertexAttrib4f = (PFNGLVERTEXATTRIB4FPROC)wglGetProcAddress("glVertexAttrib4f");
+        SwapIntervalEXT = (PFNWGLSWAPINTERVALEXTPROC)wglGetProcAddress("wglSwapIntervalEXT");
+        GetSwapIntervalEXT = (PFNWGLGETSWAPINTERVALEXTPROC)wglGetProcAddress("wglGetSwapIntervalEXT");
+        GetExtensionsStringEXT = (PFNWGLGETEXTENSIONSSTRINGEXTPROC)wglGetProcAddress("wglGetExtensionsStringEXT");
+        BlendFuncSeparate = (PFNGLBLENDFUNCSEPARATEPROC)wglGetProcAddress("glBlendFuncSeparate");
+        GenFramebuffers = (PFNGLGENFRAMEBUFFERSPROC)wglGetProcAddress("glGenFramebuffers");
+        BindFramebuffer = (PFNGLBINDFRAMEBUFFERPROC)wglGetProcAddress("glBindFramebuffer");
+        FramebufferTexture2D = (PFNGLFRAMEBUFFERTEXTURE2DPROC)wglGetProcAddress("glFramebufferTexture2D");
+        CheckFramebufferStatus = (PFNGLCHECKFRAMEBUFFERSTATUSPROC)wglGetProcAddress("glCheckFramebufferStatus");
+        DeleteFramebuffers = (PFNGLDELETEFRAMEBUFFERSPROC)wglGetProcAddress("glDeleteFramebuffers");
+        GenRenderbuffers = (PFNGLGENRENDERBUFFERSPROC)wglGetProcAddress("glGenRenderbuffers");
+        BindRenderbuffer = (PFNGLBINDRENDERBUFFERPROC)wglGetProcAddress("glBindRenderbuffer");
+        RenderbufferStorage = (PFNGLRENDERBUFFERSTORAGEPROC)wglGetProcAddress("glRenderbufferStorage");
+        FramebufferRenderbuffer = (PFNGLFRAMEBUFFERRENDERBUFFERPROC)wglGetProcAddress("glFramebufferRenderbuffer");
+        DeleteRenderbuffers = (PFNGLDELETERENDERBUFFERSPROC)wglGetProcAddress("glDeleteRenderbuffers");
+        GenQueries = (PFNGLGENQUERIESPROC)wglGetProcAddress("glGenQueries");
+        DeleteQueries = (PFNGLDELETEQUERIESPROC)wglGetProcAddress("glDeleteQueries");
+        QueryCounter = (PFNGLQUERYCOUNTERPROC)wglGetProcAddress("glQueryCounter");
+        GetQueryObjectiv = (PFNGLGETQUERYOBJECTIVPROC)wglGetProcAddress("glGetQueryObjectiv");
+        GetQueryObjectui64v = (PFNGLGETQUERYOBJECTUI64VPROC)wglGetProcAddress("glGetQueryObjectui64v");
         // TODO: add sanity checks for obtained procedures
 
         GenVertexArrays(1, &vertexArray);
-        BindVertexArray(vertexArray);
+        bindVertexArray(vertexArray);
 
         GenBuffers(1, &arrayBuffer);
-        BindBuffer(GL_ARRAY_BUFFER, arrayBuffer);
+        bindArrayBuffer(arrayBuffer);
         BufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_DYNAMIC_DRAW);
 
-        texShader.id = buildShaderProgram((char*)DEFAULT_VERTEX_SHADER, (char*)DEFAULT_FRAG_SHADER);
-        texShader.uniforms[UNIFORM_MVP] = GetUniformLocation(texShader.id, "MVP");
-        texShader.uniforms[UNIFORM_TEX] = GetUniformLocation(texShader.id, "sampler");
+        // The VAO keeps the attribute setup, no need to redo it per batch
+        enableVertexAttribs();
+
+        loadShader(shaders[SHADER_TEX], getVertexShader<Vertex>(), DEFAULT_FRAG_SHADER);
+        loadShader(shaders[SHADER_SDF], getVertexShader<Vertex>(), SDF_FRAG_SHADER);
+        ActiveTexture(GL_TEXTURE0);
+
+        // Rows of 1 and 2 byte formats aren't 4 byte aligned in general
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+        const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+        hasS3tc = extensions != NULL 
+            && strstr(extensions, "GL_EXT_texture_compression_s3tc") != NULL;
+        hasTimerQuery = extensions != NULL 
+            && strstr(extensions, "GL_ARB_timer_query") != NULL
+            && QueryCounter != NULL && GetQueryObjectui64v != NULL;
+
+        // Negative intervals are only valid with the tear extension
+        const char* wglExtensions = GetExtensionsStringEXT != NULL ? GetExtensionsStringEXT() : NULL;
+        hasSwapTear = wglExtensions != NULL 
+            && strstr(wglExtensions, "WGL_EXT_swap_control_tear") != NULL;
 
-        glEnable(GL_BLEND);
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        // Without the extension, whatever the driver does counts as no vsync
+        if (GetSwapIntervalEXT != NULL) {
+            swapInterval = GetSwapIntervalEXT();
+        }
+
+        // Depth writes are on by default, the rest of the cache starts off.
+        // The layered pass is the only one testing depth, always this way.
+        state.depthWrite = true;
+        glDepthFunc(GL_LEQUAL);
+        setBlend(true);
+        setStraightBlend();
 
         initialized = true;
     }
 
     void setScreen(int w, int h)
     {
-        static const float BASE_ORTHO[] = {
-           2.f,  0.f, 0.f, 0.f,
-           0.f, -2.f, 0.f, 0.f,
-           0.f,  0.f, 0.f, 0.f,
-          -1.f,  1.f, 0.f, 1.f,
-        };
-        memcpy(orthoProj, BASE_ORTHO, sizeof(BASE_ORTHO));
-        orthoProj[0] /= w;
-        orthoProj[5] /= h;
+        screenWidth = w;
+        screenHeight = h;
+        // Inside a layer the new size applies once it ends
+        if (activeTarget < 0) {
+            setTarget(w, h, false);
+        }
+    }
 
-        glViewport(0, 0, w, h);
+    // Size of what's being drawn to, the layer's inside one
+    void getScreenSize(int& w, int& h) const
+    {
+        w = targetWidth;
+        h = targetHeight;
     }
 
-    int addTexture(const unsigned char* data, int w, int h)
+    // 0 disables vsync, 1 waits for every vertical blank, -1 lets late 
+    // frames tear where the driver supports it. Returns false if the 
+    // interval can't be changed.
+    bool setSwapInterval(int interval)
     {
-        GLuint id;
+        if (!canSetSwapInterval(interval) || !SwapIntervalEXT(interval)) {
+            return false;
+        }
+        swapInterval = interval;
+        return true;
+    }
 
-        glGenTextures(1, &id);
-        glBindTexture(GL_TEXTURE_2D, id);
+    // Driver support, which doesn't change after init
+    bool canSetSwapInterval(int interval) const
+    {
+        return SwapIntervalEXT != NULL && (interval >= 0 || hasSwapTear);
+    }
 
-        glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_TRUE);
+    bool hasTargets() const
+    {
+        return GenFramebuffers != NULL && GenRenderbuffers != NULL;
+    }
 
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    bool hasGpuTimers() const
+    {
+        return hasTimerQuery;
+    }
 
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    int getSwapInterval() const
+    {
+        return swapInterval;
+    }
 
-        glTexEnvf(GL_TEXTURE_FILTER_CONTROL, GL_TEXTURE_LOD_BIAS, -0.25f);
+    static const int SHADER_TEX = 0;
+    static const int SHADER_SDF = 1;
+    static const int SHADERS_LEN = 2;
+
+    // Render targets and glyph atlases included
+    static const int TEXTURES_MAX = 256;
+
+    // Quads using the texture are drawn with the given shader. Textures 
+    // updated often, like glyph atlases, are better off without mipmaps.
+    // data is RGBA8 whatever the format, it gets packed before upload.
+    // A copy of it is kept to reload the texture after an eviction.
+    // Returns -1 if there are no free texture slots.
+    int addTexture(const unsigned char* data, int w, int h, 
+                   bool mipmaps = true, int shader = SHADER_TEX, 
+                   int format = TEXTURE_RGBA8)
+    {
+        int hTexture = 0;
+        while (hTexture < texturesLen && textures[hTexture].used) {
+            hTexture++;
+        }
+        if (hTexture == TEXTURES_MAX) {
+            return -1;
+        }
+
+        if (format < TEXTURE_RGBA8 || format > TEXTURE_BC3) {
+            format = TEXTURE_RGBA8;
+        }
+        if (hasS3tc == false && format == TEXTURE_BC1) {
+            format = TEXTURE_RGB565;
+        }
+        if (hasS3tc == false && format == TEXTURE_BC3) {
+            format = TEXTURE_RGBA4444;
+        }
 
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 
-                     (GLsizei)w, (GLsizei)h, 
-                     0, GL_RGBA, 
-                     GL_UNSIGNED_BYTE, data);
+        Texture& tex = textures[hTexture];
+        tex.id = 0;
+        tex.shader = shader;
+        tex.format = format;
+        tex.w = w;
+        tex.h = h;
+        tex.mipmaps = mipmaps;
+        tex.used = true;
+        tex.bytes = getTextureBytes(format, w, h, mipmaps);
+        tex.framebuffer = 0;
+        tex.depthbuffer = 0;
+        tex.premultiplied = false;
+        tex.source = new unsigned char[w*h*4];
+        if (data != NULL) {
+            memcpy(tex.source, data, w*h*4);
+        } else {
+            memset(tex.source, 0, w*h*4);
+        }
+        tex.lastUse = useClock++;
+
+        if (hTexture == texturesLen) {
+            texturesLen++;
+        }
 
-        textures[textureLen] = id;
-        return textureLen++;
+        makeResident(hTexture);
+        return hTexture;
     }
 
-    void setTexture(int hTexture)
+    // Drops the texture and its slot, batches using it are not drawn anymore
+    void releaseTexture(int hTexture)
     {
-        if (hTexture != activeHTexture) {
+        if (hTexture < 0 || hTexture >= texturesLen || !textures[hTexture].used) {
+            return;
+        }
+
+        if (activeHTexture == hTexture) {
             flush();
-            activeHTexture = hTexture;
         }
+        for (int i=0; i<layeredLen; i++) 
+        {
+            if (layered[i].hTexture == hTexture) 
+            {
+                flushLayered();
+                break;
+            }
+        }
+
+        Texture& tex = textures[hTexture];
+        if (tex.framebuffer != 0) 
+        {
+            if (activeTarget == hTexture) {
+                endTarget();
+            }
+            DeleteFramebuffers(1, &tex.framebuffer);
+            DeleteRenderbuffers(1, &tex.depthbuffer);
+            tex.framebuffer = 0;
+            tex.depthbuffer = 0;
+            residentBytes -= tex.w*tex.h*4;
+            tex.bytes -= tex.w*tex.h*4;
+        }
+        unloadTexture(hTexture);
+        delete[] tex.source;
+        tex.source = NULL;
+        tex.used = false;
     }
 
-    void flush()
+    // A texture that can be drawn into with beginTarget, starts out 
+    // transparent. Returns -1 if the driver can't render to textures.
+    int createTarget(int w, int h)
     {
-        if (verticesLen == 0) {
-            return;
+        if (!hasTargets()) {
+            return -1;
         }
 
-        UseProgram(texShader.id);
-        UniformMatrix4fv(texShader.uniforms[UNIFORM_MVP], 1, GL_FALSE, orthoProj);
+        int hTexture = addTexture(NULL, w, h, false);
+        if (hTexture < 0) {
+            return -1;
+        }
 
-        BindBuffer(GL_ARRAY_BUFFER, arrayBuffer);
-        BufferSubData(GL_ARRAY_BUFFER, 0, verticesLen*sizeof(Vertex), vertices);
+        // The content only exists on the GPU, evicting it would lose it
+        Texture& tex = textures[hTexture];
+        delete[] tex.source;
+        tex.source = NULL;
+        tex.premultiplied = true;
+
+        // Depth for the layered pass, which works inside targets as well.
+        // It counts against the budget like the color texture.
+        evictTextures(w*h*4, hTexture);
+        GenRenderbuffers(1, &tex.depthbuffer);
+        BindRenderbuffer(GL_RENDERBUFFER, tex.depthbuffer);
+        RenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, w, h);
+        tex.bytes += w*h*4;
+        residentBytes += w*h*4;
+
+        GenFramebuffers(1, &tex.framebuffer);
+        BindFramebuffer(GL_FRAMEBUFFER, tex.framebuffer);
+        FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex.id, 0);
+        FramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, tex.depthbuffer);
+        bool complete = CheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+        BindFramebuffer(GL_FRAMEBUFFER, activeTarget >= 0 ? textures[activeTarget].framebuffer : 0);
+
+        if (!complete) 
+        {
+            releaseTexture(hTexture);
+            return -1;
+        }
+        return hTexture;
+    }
+
+    // Everything drawn until endTarget goes into the target, which gets 
+    // cleared first. Starting another target ends the current one.
+    void beginTarget(int hTexture)
+    {
+        endTarget();
+        if (!isTextureValid(hTexture) || textures[hTexture].framebuffer == 0) {
+            return;
+        }
 
-        // vertices
-        EnableVertexAttribArray(0);
-        VertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), 0);
+        // Whatever was queued so far belongs to the screen
+        flushLayered();
+        flush();
 
-        // texture
-        ActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, textures[activeHTexture]);
-        Uniform1i(texShader.uniforms[UNIFORM_TEX], 0);
+        Texture& tex = textures[hTexture];
+        tex.lastUse = useClock++;
+        BindFramebuffer(GL_FRAMEBUFFER, tex.framebuffer);
+        activeTarget = hTexture;
+        setTarget(tex.w, tex.h, true);
 
-        EnableVertexAttribArray(1);
-        VertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)((char*)&vertices[0].tx - (char*)vertices));
+        glClearColor(0.f, 0.f, 0.f, 0.f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
 
-        // Draw the triangles!
-        glDrawArrays(GL_TRIANGLES, 0, verticesLen); 
+    void endTarget()
+    {
+        if (activeTarget < 0) {
+            return;
+        }
 
-        DisableVertexAttribArray(0);
-        DisableVertexAttribArray(1);
+        flushLayered();
+        flush();
 
-        verticesLen = 0;
+        BindFramebuffer(GL_FRAMEBUFFER, 0);
+        activeTarget = -1;
+        setTarget(screenWidth, screenHeight, false);
     }
 
-    void renderQuad(float qx, float qy, float qw, float qh,
-                    float tx, float ty, float tw, float th)
+    // Textures not bound for longest are evicted from the GPU when the 
+    // resident ones would take more than bytes, 0 means no limit
+    void setTextureBudget(int bytes)
     {
-        if (verticesLen > VERTEX_BUF_SIZE - 6) {
-            flush();
+        textureBudget = bytes;
+        evictTextures(0, -1);
+    }
+
+    // Replaces whole rows [y, y+h) of a texture that is w texels wide, 
+    // data is RGBA8. Rows of BC textures must be in whole 4x4 blocks. 
+    // Render targets have no source copy to update and are left alone.
+    void updateTextureRows(int hTexture, int y, int w, int h, const unsigned char* data)
+    {
+        if (!isTextureValid(hTexture) || textures[hTexture].source == NULL) {
+            return;
         }
 
-        Vertex* v = &vertices[verticesLen];
+        Texture& tex = textures[hTexture];
+        memcpy(tex.source + y*tex.w*4, data, w*h*4);
 
-        v[0] = Vertex(qx, qy, tx, ty);
-        v[1] = Vertex(qx, qy+qh, tx, ty+th);
-        v[2] = Vertex(qx+qw, qy, tx+tw, ty);
+        // An evicted texture picks the rows up when reloaded
+        if (tex.id == 0) {
+            return;
+        }
 
-        v[3] = v[1];
-        v[4] = Vertex(qx+qw, qy+qh, tx+tw, ty+th);
-        v[5] = v[2];
+        const TextureLayout& layout = TEXTURE_LAYOUTS[tex.format];
+        unsigned char* packed = packTexels(tex.format, data, w*h);
 
-        verticesLen += 6;
+        bindTexture(tex.id);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y, w, h, layout.format, layout.type, 
+                        packed != NULL ? packed : data);
+        delete[] packed;
     }
 
-private:
-    GLuint compileShader(const char* shaderSrc, GLuint type)
+    // Only takes effect with the next quad, so switching back and forth 
+    // without drawing anything doesn't break the batch
+    void setTexture(int hTexture)
     {
-        GLuint shaderId = CreateShader(type);
-        ShaderSource(shaderId, 1, &shaderSrc, NULL);
-        CompileShader(shaderId);
-
-        GLint result = GL_FALSE;
-        GetShaderiv(shaderId, GL_COMPILE_STATUS, &result);
-        if (result != GL_TRUE)
-        {
-            int infoLogLen = 0;
-            GetShaderiv(shaderId, GL_INFO_LOG_LENGTH, &infoLogLen);
-            clamp(infoLogLen, 0, 1023);
-            char errorMsg[1024];
-            GetShaderInfoLog(shaderId, infoLogLen, NULL, errorMsg);
-            //fprintf(stderr, "Error compiling shader:\n%s\n", shaderSrc);
-            //fprintf(stderr, "%s\n", errorMsg);
-            exit(EXIT_FAILURE);
+        nextHTexture = hTexture;
+        if (hTexture >= 0 && hTexture < texturesLen) {
+            textures[hTexture].lastUse = useClock++;
         }
+    }
 
-        return shaderId;
+    int getTexture() const
+    {
+        return nextHTexture;
     }
-    
-    GLuint buildShaderProgram(const char* vertexShaderSrc, const char* fragmentShaderSrc)
+
+    void flush()
     {
-        GLuint vertexShaderId = compileShader(vertexShaderSrc, GL_VERTEX_SHADER);
-        GLuint fragmentShaderId = compileShader(fragmentShaderSrc, GL_FRAGMENT_SHADER);
+        if (verticesLen == 0) {
+            return;
+        }
 
-        // Link
-        GLuint programId = CreateProgram();
-        AttachShader(programId, vertexShaderId);
-        AttachShader(programId, fragmentShaderId);
-        LinkProgram(programId);
+        // Quads of a released texture are dropped
+        if (!isTextureValid(activeHTexture)) 
+        {
+            verticesLen = 0;
+            return;
+        }
 
-        // Free resources
-        DeleteShader(vertexShaderId);
+        ShaderProgram& shader = shaders[textures[activeHTexture].shader];
+        useProgram(shader.id);
+        uploadMvp(shader);
+
+        bindVertexArray(vertexArray);
+        bindArrayBuffer(arrayBuffer);
+        BufferSubData(GL_ARRAY_BUFFER, 0, verticesLen*sizeof(Vertex), vertices);
+
+        bindTextureHandle(activeHTexture);
+        setPremultipliedBlend(textures[activeHTexture].premultiplied);
+
+        // Draw the triangles!
+        beginGpuTimer();
+        glDrawArrays(GL_TRIANGLES, 0, verticesLen); 
+        endGpuTimer(activeHTexture, verticesLen);
+        frameStats.drawCalls++;
+
+        verticesLen = 0;
+    }
+
+    // Called once the frame is complete, before swapping buffers
+    void endFrame()
+    {
+        endTarget();
+        flush();
+        flushLayered();
+        frameStats.textureBytes = residentBytes;
+        lastFrameStats = frameStats;
+        memset(&frameStats, 0, sizeof(frameStats));
+
+        if (gpuTimersEnabled) {
+            endGpuTimerFrame();
+        }
+
+        // Textures bound from now on belong to the next frame
+        frameStartUse = useClock;
+    }
+
+    // Stats of the last completed frame
+    const RenderStats& getStats() const
+    {
+        return lastFrameStats;
+    }
+
+    // Timestamps get queried around every draw call while enabled. Returns
+    // false if the driver can't do it.
+    bool setGpuTimers(bool enable)
+    {
+        if (enable == gpuTimersEnabled) {
+            return true;
+        }
+        if (enable && !hasTimerQuery) {
+            return false;
+        }
+
+        for (int i=0; i<GPU_TIMER_FRAMES; i++) 
+        {
+            GpuTimerFrame& frame = gpuTimerFrames[i];
+            if (enable) 
+            {
+                GenQueries(GPU_TIMER_QUERIES, frame.queries);
+            } 
+            else 
+            {
+                DeleteQueries(GPU_TIMER_QUERIES, frame.queries);
+                frame.pending = false;
+                frame.queriesLen = 0;
+            }
+        }
+        gpuTimersEnabled = enable;
+        gpuTimingsValid = false;
+        return true;
+    }
+
+    // Latest frame whose queries came back, false if there's none yet
+    bool getGpuTimings(GpuTimings& result) const
+    {
+        if (!gpuTimingsValid) {
+            return false;
+        }
+        result = gpuTimings;
+        return true;
+    }
+
+    // Queues a quad for the layered pass. Depth goes from 0 (front) to 1.
+    // Opaque quads are drawn first, front to back with depth test and 
+    // write and no blending, so covered pixels are shaded only once. 
+    // Blended quads follow, back to front, tested against them.
+    void renderQuadLayered(float qx, float qy, float qw, float qh,
+                           float tx, float ty, float tw, float th,
+                           float depth, bool opaque, unsigned int color)
+    {
+        if (layeredLen == LAYERED_MAX) {
+            flushLayered();
+        }
+
+        clamp(depth, 0.f, 1.f);
+
+        LayeredQuad& lq = layered[layeredLen];
+        lq.quad[0] = qx;
+        lq.quad[1] = qy;
+        lq.quad[2] = qw;
+        lq.quad[3] = qh;
+        lq.quad[4] = tx;
+        lq.quad[5] = ty;
+        lq.quad[6] = tw;
+        lq.quad[7] = th;
+        lq.color = color;
+        lq.depth = depth;
+        lq.hTexture = nextHTexture;
+        lq.opaque = opaque;
+        lq.order = layeredLen;
+        layeredLen++;
+    }
+
+    // Draws the queued layered quads on top of everything drawn so far
+    void flushLayered()
+    {
+        if (layeredLen == 0) {
+            return;
+        }
+
+        flush();
+        int hTexture = nextHTexture;
+
+        if (Vertex::HAS_DEPTH)
+        {
+            // Opaque quads first
+            int opaqueLen = 0;
+            for (int i=0; i<layeredLen; i++) 
+            {
+                if (layered[i].opaque) 
+                {
+                    LayeredQuad tmp = layered[opaqueLen];
+                    layered[opaqueLen] = layered[i];
+                    layered[i] = tmp;
+                    opaqueLen++;
+                }
+            }
+            qsort(layered, opaqueLen, sizeof(LayeredQuad), compareOpaque);
+            qsort(layered + opaqueLen, layeredLen - opaqueLen, sizeof(LayeredQuad), compareBlended);
+
+            setBlend(false);
+            setDepthTest(true, true);
+            drawLayered(layered, opaqueLen);
+
+            setBlend(true);
+            setDepthTest(true, false);
+            drawLayered(layered + opaqueLen, layeredLen - opaqueLen);
+
+            // Depth writes must be on for the next clear
+            setDepthTest(false, true);
+        }
+        else
+        {
+            // No depth to test against, so everything goes back to front 
+            // and covered pixels get shaded again
+            qsort(layered, layeredLen, sizeof(LayeredQuad), compareBlended);
+            drawLayered(layered, layeredLen);
+        }
+
+        // The quads' textures were stamped as used when they got queued
+        nextHTexture = hTexture;
+        layeredLen = 0;
+    }
+
+    // color is packed as 0xRRGGBBAA, ignored by layouts without a tint
+    void renderQuad(float qx, float qy, float qw, float qh,
+                    float tx, float ty, float tw, float th,
+                    unsigned int color = 0xFFFFFFFF)
+    {
+        writeQuad(reserveQuad(), qx, qy, qw, qh, tx, ty, tw, th, color);
+    }
+
+    // Rotates (in radians) and scales the quad around the pivot, which is 
+    // relative to the quad's top-left corner
+    void renderQuadEx(float qx, float qy, float qw, float qh,
+                      float tx, float ty, float tw, float th,
+                      float pivotX, float pivotY, 
+                      float rotation, float scaleX, float scaleY,
+                      unsigned int color)
+    {
+        SpriteTransform t;
+        t.pivotX = qx + pivotX;
+        t.pivotY = qy + pivotY;
+        t.rotation = rotation;
+        t.scaleX = scaleX;
+        t.scaleY = scaleY;
+        t.color = color;
+        t.cosA = 1.f;
+        t.sinA = 0.f;
+        if (Vertex::GPU_TRANSFORM == false) 
+        {
+            t.cosA = cosf(rotation);
+            t.sinA = sinf(rotation);
+        }
+
+        float x0 = -pivotX;
+        float y0 = -pivotY;
+        float x1 = qw - pivotX;
+        float y1 = qh - pivotY;
+
+        Vertex* v = reserveQuad();
+        v[0] = makeTransformedVertex<Vertex>(t, x0, y0, tx, ty);
+        v[1] = makeTransformedVertex<Vertex>(t, x0, y1, tx, ty+th);
+        v[2] = makeTransformedVertex<Vertex>(t, x1, y0, tx+tw, ty);
+
+        v[3] = v[1];
+        v[4] = makeTransformedVertex<Vertex>(t, x1, y1, tx+tw, ty+th);
+        v[5] = v[2];
+    }
+
+    // m is { a, b, c, d, tx, ty }, corners are transformed on the CPU so 
+    // every vertex layout takes them as they are
+    void renderQuadAffine(const float* m,
+                          float qx, float qy, float qw, float qh,
+                          float tx, float ty, float tw, float th,
+                          unsigned int color)
+    {
+        float x0 = qx, y0 = qy;
+        float x1 = qx + qw, y1 = qy + qh;
+
+        Vertex* v = reserveQuad();
+        v[0] = Vertex(m[0]*x0 + m[2]*y0 + m[4], m[1]*x0 + m[3]*y0 + m[5], tx, ty, color);
+        v[1] = Vertex(m[0]*x0 + m[2]*y1 + m[4], m[1]*x0 + m[3]*y1 + m[5], tx, ty+th, color);
+        v[2] = Vertex(m[0]*x1 + m[2]*y0 + m[4], m[1]*x1 + m[3]*y0 + m[5], tx+tw, ty, color);
+
+        v[3] = v[1];
+        v[4] = Vertex(m[0]*x1 + m[2]*y1 + m[4], m[1]*x1 + m[3]*y1 + m[5], tx+tw, ty+th, color);
+        v[5] = v[2];
+    }
+
+    // Tilemap chunks get a pool of their own, so that a big map can't use 
+    // up the batches Sys_CreateStaticBatch hands out
+    static const int STATIC_BATCHES_MAX = 256;
+    static const int CHUNK_BATCHES_MAX = 128;
+
+    // quads holds 8 floats per quad, in the same order as renderQuad takes them.
+    // The vertices are uploaded once and never touched again. Takes the 
+    // lowest free slot of its pool, released ones included.
+    int addStaticBatch(int hTexture, const float* quads, int quadsLen, bool chunk = false)
+    {
+        int hBatch = chunk ? STATIC_BATCHES_MAX : 0;
+        int end = chunk ? STATIC_BATCHES_MAX + CHUNK_BATCHES_MAX : STATIC_BATCHES_MAX;
+        while (hBatch < end && staticBatches[hBatch].used) {
+            hBatch++;
+        }
+        if (hBatch == end || quadsLen <= 0) {
+            return -1;
+        }
+
+        StaticBatch& batch = staticBatches[hBatch];
+        batch.used = true;
+
+        GenVertexArrays(1, &batch.vertexArray);
+        bindVertexArray(batch.vertexArray);
+
+        GenBuffers(1, &batch.arrayBuffer);
+        bindArrayBuffer(batch.arrayBuffer);
+
+        // Attribute pointers live in the batch's own VAO, so drawing needs no setup
+        enableVertexAttribs();
+
+        updateStaticBatch(hBatch, hTexture, quads, quadsLen);
+        return hBatch;
+    }
+
+    void releaseStaticBatch(int hBatch)
+    {
+        if (!isStaticBatchValid(hBatch)) {
+            return;
+        }
+
+        // GL hands deleted names out again, the cache mustn't take a new 
+        // object for one that's still bound
+        StaticBatch& batch = staticBatches[hBatch];
+        if (state.vertexArray == batch.vertexArray) {
+            bindVertexArray(vertexArray);
+        }
+        if (state.arrayBuffer == batch.arrayBuffer) {
+            bindArrayBuffer(arrayBuffer);
+        }
+        DeleteBuffers(1, &batch.arrayBuffer);
+        DeleteVertexArrays(1, &batch.vertexArray);
+        batch.used = false;
+    }
+
+    // Replaces the whole content of a batch, for geometry that changes rarely
+    void updateStaticBatch(int hBatch, int hTexture, const float* quads, int quadsLen)
+    {
+        StaticBatch& batch = staticBatches[hBatch];
+        batch.hTexture = hTexture;
+        batch.verticesLen = quadsLen*6;
+
+        Vertex* data = new Vertex[batch.verticesLen];
+        for (int i=0; i<quadsLen; i++)
+        {
+            const float* q = &quads[i*8];
+            writeQuad(&data[i*6], q[0], q[1], q[2], q[3], q[4], q[5], q[6], q[7], 0xFFFFFFFF);
+        }
+
+        bindArrayBuffer(batch.arrayBuffer);
+        BufferData(GL_ARRAY_BUFFER, batch.verticesLen*sizeof(Vertex), data, GL_STATIC_DRAW);
+
+        delete[] data;
+    }
+
+    void drawStaticBatch(int hBatch, float dx, float dy)
+    {
+        if (!isStaticBatchValid(hBatch)) {
+            return;
+        }
+
+        // Keep the draw order of quads submitted before this batch
+        flush();
+
+        const StaticBatch& batch = staticBatches[hBatch];
+        if (!isTextureValid(batch.hTexture)) {
+            return;
+        }
+        textures[batch.hTexture].lastUse = useClock++;
+
+        ShaderProgram& shader = shaders[textures[batch.hTexture].shader];
+
+        useProgram(shader.id);
+        if (dx != 0.f || dy != 0.f)
+        {
+            // Offset is given in pixels, vertices are in subpixels
+            float mvp[16];
+            memcpy(mvp, orthoProj, sizeof(mvp));
+            mvp[12] += mvp[0] * dx * Vertex::POS_SUBPIXELS;
+            mvp[13] += mvp[5] * dy * Vertex::POS_SUBPIXELS;
+            UniformMatrix4fv(shader.uniforms[UNIFORM_MVP], 1, GL_FALSE, mvp);
+            frameStats.stateChanges++;
+            shader.mvpSerial = -1;
+        } else {
+            uploadMvp(shader);
+        }
+
+        bindTextureHandle(batch.hTexture);
+        setPremultipliedBlend(textures[batch.hTexture].premultiplied);
+        bindVertexArray(batch.vertexArray);
+        beginGpuTimer();
+        glDrawArrays(GL_TRIANGLES, 0, batch.verticesLen);
+        endGpuTimer(batch.hTexture, batch.verticesLen);
+        frameStats.drawCalls++;
+    }
+
+private:
+    struct LayeredQuad
+    {
+        float quad[8];
+        unsigned int color;
+        float depth;
+        int hTexture;
+        int order;
+        bool opaque;
+    };
+    static const int LAYERED_MAX = 16384;
+
+    // Queries of a frame: its start, the end of each batch, its end
+    static const int GPU_TIMER_QUERIES = GPU_TIMINGS_BATCHES_MAX + 2;
+    // Frames in flight before results have to be back
+    static const int GPU_TIMER_FRAMES = 4;
+    struct GpuTimerFrame
+    {
+        GLuint queries[GPU_TIMER_QUERIES];
+        // Start and batch stamps issued so far, 0 before the first draw
+        int queriesLen;
+        int batchesUntimed;
+        GpuBatchTiming batches[GPU_TIMINGS_BATCHES_MAX];
+        float cpuMs;
+        bool pending;
+    };
+
+    // How each TextureFormat is stored and what the upload data looks like
+    struct TextureLayout
+    {
+        GLint internalFormat;
+        GLenum format;
+        GLenum type;
+    };
+    static const TextureLayout TEXTURE_LAYOUTS[];
+
+    // RGBA8 data converted to the format's upload layout, NULL if it can 
+    // be uploaded as is. Owned by the caller.
+    static unsigned char* packTexels(int format, const unsigned char* data, int texelsLen)
+    {
+        int texelSize = TexFormat_GetTexelSize(format);
+        if (data == NULL || texelSize == 4) {
+            return NULL;
+        }
+
+        unsigned char* packed = new unsigned char[texelsLen*texelSize];
+        TexFormat_Convert(format, data, texelsLen, packed);
+        return packed;
+    }
+
+    static int getTextureBytes(int format, int w, int h, bool mipmaps)
+    {
+        int bytes = 0;
+        if (format == TEXTURE_BC1 || format == TEXTURE_BC3) {
+            bytes = ((w+3)/4) * ((h+3)/4) * (format == TEXTURE_BC1 ? 8 : 16);
+        } else {
+            bytes = w * h * TexFormat_GetTexelSize(format);
+        }
+        // The mip chain adds about a third
+        return mipmaps ? bytes + bytes/3 : bytes;
+    }
+
+    bool isTextureValid(int hTexture) const
+    {
+        return hTexture >= 0 && hTexture < texturesLen && textures[hTexture].used;
+    }
+
+    bool isStaticBatchValid(int hBatch) const
+    {
+        return hBatch >= 0 && hBatch < STATIC_BATCHES_MAX + CHUNK_BATCHES_MAX 
+            && staticBatches[hBatch].used;
+    }
+
+    // Uploads the texture from its source copy if it's not on the GPU
+    void makeResident(int hTexture)
+    {
+        Texture& tex = textures[hTexture];
+        if (tex.id != 0) {
+            return;
+        }
+
+        evictTextures(tex.bytes, hTexture);
+
+        glGenTextures(1, &tex.id);
+        bindTexture(tex.id);
+
+        if (tex.mipmaps) {
+            glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_TRUE);
+        }
+
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, 
+                        tex.mipmaps ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+
+        glTexEnvf(GL_TEXTURE_FILTER_CONTROL, GL_TEXTURE_LOD_BIAS, -0.25f);
+
+        const TextureLayout& layout = TEXTURE_LAYOUTS[tex.format];
+        unsigned char* packed = packTexels(tex.format, tex.source, tex.w*tex.h);
+        glTexImage2D(GL_TEXTURE_2D, 0, layout.internalFormat, 
+                     (GLsizei)tex.w, (GLsizei)tex.h, 
+                     0, layout.format, 
+                     layout.type, packed != NULL ? packed : tex.source);
+        delete[] packed;
+
+        residentBytes += tex.bytes;
+    }
+
+    void unloadTexture(int hTexture)
+    {
+        Texture& tex = textures[hTexture];
+        if (tex.id == 0) {
+            return;
+        }
+
+        // Deleting a bound texture reverts the binding to 0
+        if (state.texture == tex.id) {
+            state.texture = 0;
+        }
+        glDeleteTextures(1, &tex.id);
+        tex.id = 0;
+        residentBytes -= tex.bytes;
+    }
+
+    // Evicts least recently bound textures until bytes more fit in the 
+    // budget. Textures bound during the current frame are kept, so a 
+    // frame that needs more than the budget goes over it instead of 
+    // reloading textures back and forth.
+    void evictTextures(int bytes, int hKeep)
+    {
+        while (textureBudget > 0 && residentBytes + bytes > textureBudget)
+        {
+            int hOldest = -1;
+            for (int i=0; i<texturesLen; i++) 
+            {
+                const Texture& tex = textures[i];
+                if (i == hKeep || tex.id == 0 || tex.lastUse >= frameStartUse) {
+                    continue;
+                }
+                // Nothing to reload render targets from
+                if (tex.framebuffer != 0) {
+                    continue;
+                }
+                if (hOldest < 0 || tex.lastUse < textures[hOldest].lastUse) {
+                    hOldest = i;
+                }
+            }
+
+            if (hOldest < 0) {
+                break;
+            }
+            unloadTexture(hOldest);
+            frameStats.textureEvictions++;
+        }
+    }
+
+    // Binds the texture, reloading it first if it was evicted
+    void bindTextureHandle(int hTexture)
+    {
+        if (textures[hTexture].id == 0) 
+        {
+            makeResident(hTexture);
+            frameStats.textureReloads++;
+        }
+        bindTexture(textures[hTexture].id);
+    }
+
+    static int compareOpaque(const void* a, const void* b)
+    {
+        // By texture to keep batches long, then front to back. The depth 
+        // test takes care of the order between textures.
+        const LayeredQuad& qa = *(const LayeredQuad*)a;
+        const LayeredQuad& qb = *(const LayeredQuad*)b;
+        if (qa.hTexture != qb.hTexture) {
+            return qa.hTexture - qb.hTexture;
+        }
+        if (qa.depth != qb.depth) {
+            return qa.depth < qb.depth ? -1 : 1;
+        }
+        return qa.order - qb.order;
+    }
+
+    static int compareBlended(const void* a, const void* b)
+    {
+        // Back to front, submission order within a layer
+        const LayeredQuad& qa = *(const LayeredQuad*)a;
+        const LayeredQuad& qb = *(const LayeredQuad*)b;
+        if (qa.depth != qb.depth) {
+            return qa.depth > qb.depth ? -1 : 1;
+        }
+        return qa.order - qb.order;
+    }
+
+    // Draws sorted quads, batches only break where the texture changes
+    void drawLayered(const LayeredQuad* quads, int quadsLen)
+    {
+        for (int i=0; i<quadsLen; i++)
+        {
+            const LayeredQuad& lq = quads[i];
+            nextHTexture = lq.hTexture;
+            const float* q = lq.quad;
+            Vertex* v = reserveQuad();
+            writeQuad(v, q[0], q[1], q[2], q[3], q[4], q[5], q[6], q[7], lq.color);
+            for (int k=0; k<6; k++) {
+                v[k].setDepth(lq.depth);
+            }
+        }
+        flush();
+    }
+
+    // The first draw of a frame stamps its start, every draw stamps its end
+    void beginGpuTimer()
+    {
+        if (!gpuTimersEnabled) {
+            return;
+        }
+
+        GpuTimerFrame& frame = gpuTimerFrames[gpuTimerFrame];
+        if (frame.queriesLen == 0) 
+        {
+            QueryCounter(frame.queries[0], GL_TIMESTAMP);
+            frame.queriesLen = 1;
+            frame.batchesUntimed = 0;
+            cpuTimer.reset();
+        }
+    }
+
+    void endGpuTimer(int hTexture, int verticesLen)
+    {
+        if (!gpuTimersEnabled) {
+            return;
+        }
+
+        GpuTimerFrame& frame = gpuTimerFrames[gpuTimerFrame];
+        // The last query is kept for the end of the frame
+        if (frame.queriesLen == GPU_TIMER_QUERIES - 1) 
+        {
+            frame.batchesUntimed++;
+            return;
+        }
+
+        GpuBatchTiming& batch = frame.batches[frame.queriesLen - 1];
+        batch.hTexture = hTexture;
+        batch.vertices = verticesLen;
+        QueryCounter(frame.queries[frame.queriesLen++], GL_TIMESTAMP);
+    }
+
+    // Stamps the end of the frame, then picks up whatever earlier frames 
+    // the GPU is done with. Frames still in flight when their slot comes 
+    // around again are dropped rather than waited for.
+    void endGpuTimerFrame()
+    {
+        GpuTimerFrame& frame = gpuTimerFrames[gpuTimerFrame];
+        if (frame.queriesLen > 0) 
+        {
+            QueryCounter(frame.queries[frame.queriesLen], GL_TIMESTAMP);
+            frame.cpuMs = (float)(cpuTimer.getDeltaSeconds() * 1000.0);
+            frame.pending = true;
+        }
+
+        // Oldest first, so results never go back in time
+        for (int i=1; i<=GPU_TIMER_FRAMES; i++)
+        {
+            int slot = (gpuTimerFrame + i) % GPU_TIMER_FRAMES;
+            if (!gpuTimerFrames[slot].pending) {
+                continue;
+            }
+            if (!readGpuTimerFrame(gpuTimerFrames[slot], GPU_TIMER_FRAMES - i)) {
+                break;
+            }
+        }
+
+        gpuTimerFrame = (gpuTimerFrame + 1) % GPU_TIMER_FRAMES;
+        gpuTimerFrames[gpuTimerFrame].pending = false;
+        gpuTimerFrames[gpuTimerFrame].queriesLen = 0;
+    }
+
+    // False if the frame's last query isn't available yet, which means 
+    // none of the later ones are either
+    bool readGpuTimerFrame(GpuTimerFrame& frame, int latency)
+    {
+        GLint available = 0;
+        GetQueryObjectiv(frame.queries[frame.queriesLen], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) {
+            return false;
+        }
+
+        GLuint64 stamps[GPU_TIMER_QUERIES];
+        for (int i=0; i<=frame.queriesLen; i++) {
+            GetQueryObjectui64v(frame.queries[i], GL_QUERY_RESULT, &stamps[i]);
+        }
+
+        // Stamps are in nanoseconds
+        gpuTimings.latency = latency;
+        gpuTimings.gpuMs = (float)(stamps[frame.queriesLen] - stamps[0]) * 1e-6f;
+        gpuTimings.cpuMs = frame.cpuMs;
+        gpuTimings.batchesLen = frame.queriesLen - 1;
+        gpuTimings.batchesUntimed = frame.batchesUntimed;
+        for (int i=0; i<gpuTimings.batchesLen; i++) 
+        {
+            gpuTimings.batches[i] = frame.batches[i];
+            gpuTimings.batches[i].gpuMs = (float)(stamps[i+1] - stamps[i]) * 1e-6f;
+        }
+        gpuTimingsValid = true;
+
+        frame.pending = false;
+        return true;
+    }
+
+    // Positions map to pixels with y going down. Render targets are drawn 
+    // upside down, so their first row ends up at v = 0 like it does for 
+    // uploaded textures.
+    void setTarget(int w, int h, bool flipY)
+    {
+        static const float BASE_ORTHO[] = {
+           2.f,  0.f, 0.f, 0.f,
+           0.f, -2.f, 0.f, 0.f,
+           0.f,  0.f, 0.f, 0.f,
+          -1.f,  1.f, 0.f, 1.f,
+        };
+        memcpy(orthoProj, BASE_ORTHO, sizeof(BASE_ORTHO));
+        if (flipY) 
+        {
+            orthoProj[5] = -orthoProj[5];
+            orthoProj[13] = -orthoProj[13];
+        }
+        // Positions arrive in 1/POS_SUBPIXELS pixel units
+        orthoProj[0] /= w * Vertex::POS_SUBPIXELS;
+        orthoProj[5] /= h * Vertex::POS_SUBPIXELS;
+        mvpSerial++;
+
+        targetWidth = w;
+        targetHeight = h;
+        glViewport(0, 0, w, h);
+    }
+
+    // Straight alpha blending, except that alpha accumulates the way 
+    // premultiplied colors do, so what's drawn into a render target comes 
+    // out premultiplied. Doesn't matter for the back buffer.
+    void setStraightBlend()
+    {
+        if (BlendFuncSeparate != NULL) {
+            BlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+        } else {
+            glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        }
+    }
+
+    void setPremultipliedBlend(bool premultiplied)
+    {
+        if (state.premultiplied == premultiplied) {
+            frameStats.stateChangesElided++;
+            return;
+        }
+        if (premultiplied) {
+            glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+        } else {
+            setStraightBlend();
+        }
+        state.premultiplied = premultiplied;
+        frameStats.stateChanges++;
+    }
+
+    void setBlend(bool enabled)
+    {
+        if (state.blend == enabled) {
+            frameStats.stateChangesElided++;
+            return;
+        }
+        if (enabled) {
+            glEnable(GL_BLEND);
+        } else {
+            glDisable(GL_BLEND);
+        }
+        state.blend = enabled;
+        frameStats.stateChanges++;
+    }
+
+    void setDepthTest(bool enabled, bool write)
+    {
+        if (state.depthTest == enabled && state.depthWrite == write) {
+            frameStats.stateChangesElided++;
+            return;
+        }
+        if (state.depthTest != enabled) 
+        {
+            if (enabled) {
+                glEnable(GL_DEPTH_TEST);
+            } else {
+                glDisable(GL_DEPTH_TEST);
+            }
+        }
+        if (state.depthWrite != write) {
+            glDepthMask(write ? GL_TRUE : GL_FALSE);
+        }
+        state.depthTest = enabled;
+        state.depthWrite = write;
+        frameStats.stateChanges++;
+    }
+
+    // Room for six vertices in the current batch
+    Vertex* reserveQuad()
+    {
+        if (nextHTexture != activeHTexture) {
+            flush();
+            activeHTexture = nextHTexture;
+        }
+
+        if (verticesLen > VERTEX_BUF_SIZE - 6) {
+            flush();
+        }
+
+        Vertex* v = &vertices[verticesLen];
+        verticesLen += 6;
+        return v;
+    }
+
+    static const unsigned int UNIFORMS_MAX = 3;
+    static const unsigned int UNIFORM_MVP = 0;
+    static const unsigned int UNIFORM_TEX = 1;
+    struct ShaderProgram
+    {
+        unsigned int id;
+        unsigned int uniforms[UNIFORMS_MAX];
+        int mvpSerial;
+    };
+
+    static void writeQuad(Vertex* v, 
+                          float qx, float qy, float qw, float qh,
+                          float tx, float ty, float tw, float th,
+                          unsigned int color)
+    {
+        v[0] = Vertex(qx, qy, tx, ty, color);
+        v[1] = Vertex(qx, qy+qh, tx, ty+th, color);
+        v[2] = Vertex(qx+qw, qy, tx+tw, ty, color);
+
+        v[3] = v[1];
+        v[4] = Vertex(qx+qw, qy+qh, tx+tw, ty+th, color);
+        v[5] = v[2];
+    }
+
+    // GL state cache: every bind goes through here, so redundant calls are 
+    // skipped. Anything binding behind its back must update the state too.
+    void useProgram(GLuint id)
+    {
+        if (state.program == id) {
+            frameStats.stateChangesElided++;
+            return;
+        }
+        UseProgram(id);
+        state.program = id;
+        frameStats.stateChanges++;
+    }
+
+    void bindVertexArray(GLuint id)
+    {
+        if (state.vertexArray == id) {
+            frameStats.stateChangesElided++;
+            return;
+        }
+        BindVertexArray(id);
+        state.vertexArray = id;
+        frameStats.stateChanges++;
+    }
+
+    void bindArrayBuffer(GLuint id)
+    {
+        if (state.arrayBuffer == id) {
+            frameStats.stateChangesElided++;
+            return;
+        }
+        BindBuffer(GL_ARRAY_BUFFER, id);
+        state.arrayBuffer = id;
+        frameStats.stateChanges++;
+    }
+
+    // Texture unit 0 is the only one in use
+    void bindTexture(GLuint id)
+    {
+        if (state.texture == id) {
+            frameStats.stateChangesElided++;
+            return;
+        }
+        glBindTexture(GL_TEXTURE_2D, id);
+        state.texture = id;
+        frameStats.stateChanges++;
+    }
+
+    // Expects the shader to be bound
+    void uploadMvp(ShaderProgram& shader)
+    {
+        if (shader.mvpSerial == mvpSerial) {
+            frameStats.stateChangesElided++;
+            return;
+        }
+        UniformMatrix4fv(shader.uniforms[UNIFORM_MVP], 1, GL_FALSE, orthoProj);
+        shader.mvpSerial = mvpSerial;
+        frameStats.stateChanges++;
+    }
+
+    void loadShader(ShaderProgram& shader, const unsigned char* vertexSrc, const unsigned char* fragSrc)
+    {
+        shader.id = buildShaderProgram((char*)vertexSrc, (char*)fragSrc);
+        shader.uniforms[UNIFORM_MVP] = GetUniformLocation(shader.id, "MVP");
+        shader.uniforms[UNIFORM_TEX] = GetUniformLocation(shader.id, "sampler");
+        shader.mvpSerial = -1;
+
+        // Everything samples from unit 0, so the sampler uniform never changes
+        useProgram(shader.id);
+        Uniform1i(shader.uniforms[UNIFORM_TEX], 0);
+    }
+
+    // Points vertex attributes at the currently bound array buffer
+    void enableVertexAttribs()
+    {
+        // vertices, texture coords and optional tint
+        const VertexAttrib* attribs = Vertex::getAttribs();
+        for (int i=0; i<Vertex::ATTRIBS_LEN; i++)
+        {
+            EnableVertexAttribArray(i);
+            VertexAttribPointer(i, attribs[i].size, attribs[i].type, attribs[i].normalized, 
+                                sizeof(Vertex), (void*)attribs[i].offset);
+        }
+        if (Vertex::ATTRIBS_LEN <= ATTRIB_COLOR) {
+            VertexAttrib4f(ATTRIB_COLOR, 1.f, 1.f, 1.f, 1.f);
+        }
+    }
+
+    GLuint compileShader(const char* shaderSrc, GLuint type)
+    {
+        GLuint shaderId = CreateShader(type);
+        ShaderSource(shaderId, 1, &shaderSrc, NULL);
+        CompileShader(shaderId);
+
+        GLint result = GL_FALSE;
+        GetShaderiv(shaderId, GL_COMPILE_STATUS, &result);
+        if (result != GL_TRUE)
+        {
+            int infoLogLen = 0;
+            GetShaderiv(shaderId, GL_INFO_LOG_LENGTH, &infoLogLen);
+            clamp(infoLogLen, 0, 1023);
+            char errorMsg[1024];
+            GetShaderInfoLog(shaderId, infoLogLen, NULL, errorMsg);
+            //fprintf(stderr, "Error compiling shader:\n%s\n", shaderSrc);
+            //fprintf(stderr, "%s\n", errorMsg);
+            exit(EXIT_FAILURE);
+        }
+
+        return shaderId;
+    }
+    
+    GLuint buildShaderProgram(const char* vertexShaderSrc, const char* fragmentShaderSrc)
+    {
+        GLuint vertexShaderId = compileShader(vertexShaderSrc, GL_VERTEX_SHADER);
+        GLuint fragmentShaderId = compileShader(fragmentShaderSrc, GL_FRAGMENT_SHADER);
+
+        // Link
+        GLuint programId = CreateProgram();
+        AttachShader(programId, vertexShaderId);
+        AttachShader(programId, fragmentShaderId);
+        BindAttribLocation(programId, ATTRIB_POS, "vertexPosition_modelspace");
+        BindAttribLocation(programId, ATTRIB_UV, "vertexUv");
+        BindAttribLocation(programId, ATTRIB_COLOR, "vertexColor");
+        BindAttribLocation(programId, ATTRIB_OFFSET, "vertexOffset");
+        BindAttribLocation(programId, ATTRIB_TRANSFORM, "vertexTransform");
+        LinkProgram(programId);
+
+        // Free resources
+        DeleteShader(vertexShaderId);
         DeleteShader(fragmentShaderId);
 
         // Check for errors
@@ -388,50 +1965,114 @@ private:
 
     bool initialized;
 
-    GLuint textures[16];
-    int textureLen;
-
-    int activeHTexture;
-
-    struct Vertex
+    struct Texture
     {
-        float x;
-        float y;
-        float tx;
-        float ty;
+        // 0 while evicted
+        GLuint id;
+        int shader;
+        int format;
+        int w;
+        int h;
+        bool mipmaps;
+        // False for released slots
+        bool used;
+        // Estimated size on the GPU
+        int bytes;
+        // RGBA8 texels to reload from
+        unsigned char* source;
+        // useClock value of the last setTexture
+        unsigned int lastUse;
+        // Render targets only, with a depth buffer of their own
+        GLuint framebuffer;
+        GLuint depthbuffer;
+        bool premultiplied;
+    };
+    Texture textures[TEXTURES_MAX];
+    int texturesLen;
+
+    static const int DEFAULT_TEXTURE_BUDGET = 256*1024*1024;
+    int residentBytes;
+    int textureBudget;
+    unsigned int useClock;
+    unsigned int frameStartUse;
+    bool hasS3tc;
+    bool hasSwapTear;
+    int swapInterval;
+
+    // Render target being drawn to, -1 for the back buffer
+    int activeTarget;
+
+    bool hasTimerQuery;
+    bool gpuTimersEnabled;
+    GpuTimerFrame gpuTimerFrames[GPU_TIMER_FRAMES];
+    int gpuTimerFrame;
+    HighResTimer cpuTimer;
+    GpuTimings gpuTimings;
+    bool gpuTimingsValid;
+
+    // Texture of the pending quads and the one the next quad asks for
+    int activeHTexture;
+    int nextHTexture;
 
-        Vertex(): x(0.f), y(0.f), tx(0.f), ty(0.f)
-        {
-        }
+    static const unsigned int ATTRIB_POS = 0;
+    static const unsigned int ATTRIB_UV = 1;
+    static const unsigned int ATTRIB_COLOR = 2;
+    static const unsigned int ATTRIB_OFFSET = 3;
+    static const unsigned int ATTRIB_TRANSFORM = 4;
 
-        Vertex(float aX, float aY, float aTx, float aTy)
-            : x(aX), y(aY), tx(aTx), ty(aTy)
-        {
-        }
-    };
-    static const int VERTEX_BUF_SIZE = 512*6;
+    static const int VERTEX_BUF_SIZE = 8192*6;
     Vertex vertices[VERTEX_BUF_SIZE];
     int verticesLen;
 
-    static const unsigned int UNIFORMS_MAX = 3;
-    static const unsigned int UNIFORM_MVP = 0;
-    static const unsigned int UNIFORM_TEX = 1;
-    struct ShaderProgram
+    struct StaticBatch
     {
-        unsigned int id;
-        unsigned int uniforms[UNIFORMS_MAX];
+        GLuint vertexArray;
+        GLuint arrayBuffer;
+        int hTexture;
+        int verticesLen;
+        bool used;
     };
-    ShaderProgram texShader;
+    // Sys_CreateStaticBatch ones first, then the tilemap chunk pool
+    StaticBatch staticBatches[STATIC_BATCHES_MAX + CHUNK_BATCHES_MAX];
+
+    ShaderProgram shaders[SHADERS_LEN];
 
     GLuint vertexArray;
     GLuint arrayBuffer;
 
-    float orthoProj[16];
+    float orthoProj[16];
+    // Bumped whenever orthoProj changes, shaders compare it to their own
+    int mvpSerial;
+
+    int screenWidth;
+    int screenHeight;
+    int targetWidth;
+    int targetHeight;
+
+    LayeredQuad* layered;
+    int layeredLen;
+
+    struct GLState
+    {
+        GLuint program;
+        GLuint vertexArray;
+        GLuint arrayBuffer;
+        GLuint texture;
+        bool premultiplied;
+        bool blend;
+        bool depthTest;
+        bool depthWrite;
+    };
+    GLState state;
+
+    RenderStats frameStats;
+    RenderStats lastFrameStats;
 
     #define GLAPIENTRY __stdcall
     typedef char GLchar;
     typedef ptrdiff_t GLintptr;
     typedef ptrdiff_t GLsizeiptr;
+    typedef unsigned __int64 GLuint64;
 
     typedef void (GLAPIENTRY * PFNGLGENVERTEXARRAYSPROC)(GLsizei n, GLuint* arrs);
     typedef void (GLAPIENTRY * PFNGLBINDVERTEXARRAYPROC)(GLuint arr);
@@ -460,6 +2101,27 @@ private:
     typedef void (GLAPIENTRY * PFNGLVERTEXATTRIBPOINTERPROC)(GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const GLvoid* pointer);
     typedef void (GLAPIENTRY * PFNGLDELETEBUFFERSPROC)(GLsizei n, const GLuint* buffers);
     typedef void (GLAPIENTRY * PFNGLBUFFERSUBDATAPROC) (GLenum target, GLintptr offset, GLsizeiptr size, const GLvoid* data);
+    typedef void (GLAPIENTRY * PFNGLBINDATTRIBLOCATIONPROC)(GLuint program, GLuint index, const GLchar* name);
+    typedef void (GLAPIENTRY * PFNGLVERTEXATTRIB4FPROC)(GLuint index, GLfloat x, GLfloat y, GLfloat z, GLfloat w);
+    typedef BOOL (GLAPIENTRY * PFNWGLSWAPINTERVALEXTPROC)(int interval);
+    typedef int (GLAPIENTRY * PFNWGLGETSWAPINTERVALEXTPROC)(void);
+    typedef const char* (GLAPIENTRY * PFNWGLGETEXTENSIONSSTRINGEXTPROC)(void);
+    typedef void (GLAPIENTRY * PFNGLBLENDFUNCSEPARATEPROC)(GLenum srcRGB, GLenum dstRGB, GLenum srcAlpha, GLenum dstAlpha);
+    typedef void (GLAPIENTRY * PFNGLGENFRAMEBUFFERSPROC)(GLsizei n, GLuint* framebuffers);
+    typedef void (GLAPIENTRY * PFNGLBINDFRAMEBUFFERPROC)(GLenum target, GLuint framebuffer);
+    typedef void (GLAPIENTRY * PFNGLFRAMEBUFFERTEXTURE2DPROC)(GLenum target, GLenum attachment, GLenum textarget, GLuint texture, GLint level);
+    typedef GLenum (GLAPIENTRY * PFNGLCHECKFRAMEBUFFERSTATUSPROC)(GLenum target);
+    typedef void (GLAPIENTRY * PFNGLDELETEFRAMEBUFFERSPROC)(GLsizei n, const GLuint* framebuffers);
+    typedef void (GLAPIENTRY * PFNGLGENRENDERBUFFERSPROC)(GLsizei n, GLuint* renderbuffers);
+    typedef void (GLAPIENTRY * PFNGLBINDRENDERBUFFERPROC)(GLenum target, GLuint renderbuffer);
+    typedef void (GLAPIENTRY * PFNGLRENDERBUFFERSTORAGEPROC)(GLenum target, GLenum internalformat, GLsizei width, GLsizei height);
+    typedef void (GLAPIENTRY * PFNGLFRAMEBUFFERRENDERBUFFERPROC)(GLenum target, GLenum attachment, GLenum renderbuffertarget, GLuint renderbuffer);
+    typedef void (GLAPIENTRY * PFNGLDELETERENDERBUFFERSPROC)(GLsizei n, const GLuint* renderbuffers);
+    typedef void (GLAPIENTRY * PFNGLGENQUERIESPROC)(GLsizei n, GLuint* ids);
+    typedef void (GLAPIENTRY * PFNGLDELETEQUERIESPROC)(GLsizei n, const GLuint* ids);
+    typedef void (GLAPIENTRY * PFNGLQUERYCOUNTERPROC)(GLuint id, GLenum target);
+    typedef void (GLAPIENTRY * PFNGLGETQUERYOBJECTIVPROC)(GLuint id, GLenum pname, GLint* params);
+    typedef void (GLAPIENTRY * PFNGLGETQUERYOBJECTUI64VPROC)(GLuint id, GLenum pname, GLuint64* params);
 
     PFNGLGENVERTEXARRAYSPROC GenVertexArrays;
     PFNGLBINDVERTEXARRAYPROC BindVertexArray;
@@ -488,6 +2150,27 @@ private:
     PFNGLVERTEXATTRIBPOINTERPROC VertexAttribPointer;
     PFNGLDELETEBUFFERSPROC DeleteBuffers;
     PFNGLBUFFERSUBDATAPROC BufferSubData;
+    PFNGLBINDATTRIBLOCATIONPROC BindAttribLocation;
+    PFNGLVERTEXATTRIB4FPROC VertexAttrib4f;
+    PFNWGLSWAPINTERVALEXTPROC SwapIntervalEXT;
+    PFNWGLGETSWAPINTERVALEXTPROC GetSwapIntervalEXT;
+    PFNWGLGETEXTENSIONSSTRINGEXTPROC GetExtensionsStringEXT;
+    PFNGLBLENDFUNCSEPARATEPROC BlendFuncSeparate;
+    PFNGLGENFRAMEBUFFERSPROC GenFramebuffers;
+    PFNGLBINDFRAMEBUFFERPROC BindFramebuffer;
+    PFNGLFRAMEBUFFERTEXTURE2DPROC FramebufferTexture2D;
+    PFNGLCHECKFRAMEBUFFERSTATUSPROC CheckFramebufferStatus;
+    PFNGLDELETEFRAMEBUFFERSPROC DeleteFramebuffers;
+    PFNGLGENRENDERBUFFERSPROC GenRenderbuffers;
+    PFNGLBINDRENDERBUFFERPROC BindRenderbuffer;
+    PFNGLRENDERBUFFERSTORAGEPROC RenderbufferStorage;
+    PFNGLFRAMEBUFFERRENDERBUFFERPROC FramebufferRenderbuffer;
+    PFNGLDELETERENDERBUFFERSPROC DeleteRenderbuffers;
+    PFNGLGENQUERIESPROC GenQueries;
+    PFNGLDELETEQUERIESPROC DeleteQueries;
+    PFNGLQUERYCOUNTERPROC QueryCounter;
+    PFNGLGETQUERYOBJECTIVPROC GetQueryObjectiv;
+    PFNGLGETQUERYOBJECTUI64VPROC GetQueryObjectui64v;
 
     static const int GL_GENERATE_MIPMAP = 0x8191;
     static const int GL_TEXTURE_FILTER_CONTROL = 0x8500;
@@ -502,23 +2185,748 @@ private:
     static const int GL_STATIC_DRAW = 0x88E4;
     static const int GL_CLAMP_TO_EDGE = 0x812F;
     static const int GL_DYNAMIC_DRAW = 0x88E8;
+    static const int GL_UNSIGNED_SHORT_4_4_4_4 = 0x8033;
+    static const int GL_UNSIGNED_SHORT_5_6_5 = 0x8363;
+    static const int GL_COMPRESSED_RGB_S3TC_DXT1_EXT = 0x83F0;
+    static const int GL_COMPRESSED_RGBA_S3TC_DXT5_EXT = 0x83F3;
+    static const int GL_DEPTH_COMPONENT24 = 0x81A6;
+    static const int GL_FRAMEBUFFER = 0x8D40;
+    static const int GL_RENDERBUFFER = 0x8D41;
+    static const int GL_COLOR_ATTACHMENT0 = 0x8CE0;
+    static const int GL_DEPTH_ATTACHMENT = 0x8D00;
+    static const int GL_FRAMEBUFFER_COMPLETE = 0x8CD5;
+    static const int GL_QUERY_RESULT = 0x8866;
+    static const int GL_QUERY_RESULT_AVAILABLE = 0x8867;
+    static const int GL_TIMESTAMP = 0x8E28;
+};
+
+// Indexed by TextureFormat. Grey formats use the luminance ones, which 
+// GL 2.1 samples as (l, l, l, a) without any swizzling in the shaders.
+template <class Vertex>
+const typename GraphicsT<Vertex>::TextureLayout GraphicsT<Vertex>::TEXTURE_LAYOUTS[] = {
+    { GL_RGBA,                            GL_RGBA,            GL_UNSIGNED_BYTE },
+    { GL_LUMINANCE8,                      GL_LUMINANCE,       GL_UNSIGNED_BYTE },
+    { GL_LUMINANCE8_ALPHA8,               GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE },
+    { GL_RGB5,                            GL_RGB,             GL_UNSIGNED_SHORT_5_6_5 },
+    { GL_RGBA4,                           GL_RGBA,            GL_UNSIGNED_SHORT_4_4_4_4 },
+    { GL_COMPRESSED_RGB_S3TC_DXT1_EXT,    GL_RGBA,            GL_UNSIGNED_BYTE },
+    { GL_COMPRESSED_RGBA_S3TC_DXT5_EXT,   GL_RGBA,            GL_UNSIGNED_BYTE },
+};
+
+typedef GraphicsT<SPRITE_VERTEX> Graphics;
+
+class GdiGlyphRasterizer : public GlyphRasterizer
+{
+public:
+    GdiGlyphRasterizer(const char* face, int pixelSize)
+        : outline(NULL)
+        , outlineMax(0)
+    {
+        dc = CreateCompatibleDC(NULL);
+        font = CreateFont(-pixelSize, 0, 0, 0, FW_NORMAL, FALSE, FALSE, FALSE, 
+                          DEFAULT_CHARSET, OUT_TT_PRECIS, CLIP_DEFAULT_PRECIS, 
+                          ANTIALIASED_QUALITY, DEFAULT_PITCH, face);
+        oldFont = SelectObject(dc, font);
+        GetTextMetrics(dc, &metrics);
+    }
+
+    ~GdiGlyphRasterizer()
+    {
+        SelectObject(dc, oldFont);
+        DeleteObject(font);
+        DeleteDC(dc);
+        delete[] outline;
+    }
+
+    int getAscent()
+    {
+        return metrics.tmAscent;
+    }
+
+    int getLineHeight()
+    {
+        return metrics.tmHeight + metrics.tmExternalLeading;
+    }
+
+    bool rasterize(unsigned int codepoint, 
+                   unsigned char* coverage, int coverageMax, 
+                   GlyphMetrics& m)
+    {
+        static const MAT2 IDENTITY = { {0, 1}, {0, 0}, {0, 0}, {0, 1} };
+
+        GLYPHMETRICS gm;
+        DWORD size = GetGlyphOutline(dc, codepoint, GGO_GRAY8_BITMAP, &gm, 0, NULL, &IDENTITY);
+        if (size == GDI_ERROR) {
+            return false;
+        }
+
+        m.advance = gm.gmCellIncX;
+        m.originX = gm.gmptGlyphOrigin.x;
+        m.originY = gm.gmptGlyphOrigin.y;
+        m.w = 0;
+        m.h = 0;
+
+        // Whitespace has no bitmap, only the advance
+        if (size == 0) {
+            return true;
+        }
+
+        if (size > outlineMax) 
+        {
+            delete[] outline;
+            outline = new unsigned char[size];
+            outlineMax = size;
+        }
+        GetGlyphOutline(dc, codepoint, GGO_GRAY8_BITMAP, &gm, size, outline, &IDENTITY);
+
+        int w = (int)gm.gmBlackBoxX;
+        int h = (int)gm.gmBlackBoxY;
+        if (w*h > coverageMax) {
+            return false;
+        }
+
+        // Rows are DWORD aligned, coverage goes from 0 to 64
+        int pitch = (w + 3) & ~3;
+        for (int y=0; y<h; y++) {
+            for (int x=0; x<w; x++) {
+                coverage[y*w + x] = (unsigned char)(outline[y*pitch + x] * 255 / 64);
+            }
+        }
+
+        m.w = w;
+        m.h = h;
+        return true;
+    }
+
+private:
+    HDC dc;
+    HFONT font;
+    HGDIOBJ oldFont;
+    TEXTMETRIC metrics;
+
+    unsigned char* outline;
+    DWORD outlineMax;
+};
+
+// Fonts of one kind share an atlas page, so any text in any of them 
+// stays in one batch
+struct TextRenderer
+{
+    static const int FONTS_MAX = 16;
+
+    TextRenderer()
+        : bitmapAtlas(false)
+        , sdfAtlas(true)
+        , fontsLen(0)
+    {
+    }
+
+    ~TextRenderer()
+    {
+        for (int i=0; i<fontsLen; i++) {
+            delete fonts[i];
+        }
+    }
+
+    int loadFont(Graphics& gfx, const char* face, int pixelSize, int flags)
+    {
+        if (fontsLen >= FONTS_MAX) {
+            return -1;
+        }
+
+        bool sdf = (flags & FONT_SDF) != 0;
+        FontAtlas& atlas = sdf ? sdfAtlas : bitmapAtlas;
+        if (atlas.hTexture < 0) 
+        {
+            atlas.hTexture = gfx.addTexture(
+                atlas.getPixels(), FontAtlas::PAGE_SIZE, FontAtlas::PAGE_SIZE, 
+                false, sdf ? Graphics::SHADER_SDF : Graphics::SHADER_TEX, 
+                TEXTURE_RG8);
+            atlas.clearDirty();
+        }
+
+        // Distance fields are computed from a bigger rendition of the glyphs
+        int upscale = sdf ? SDF_UPSCALE : 1;
+        GdiGlyphRasterizer* rasterizer = new GdiGlyphRasterizer(face, pixelSize * upscale);
+        fonts[fontsLen] = new Font(rasterizer, &atlas, upscale);
+
+        return fontsLen++;
+    }
+
+    void render(Graphics& gfx, int hFont, float x, float y, float scale, 
+                unsigned int color, const char* text)
+    {
+        if (hFont < 0 || hFont >= fontsLen) {
+            return;
+        }
+
+        Font* font = fonts[hFont];
+        FontAtlas* atlas = font->getAtlas();
+
+        int generation = atlas->getGeneration();
+        int quadsLen = 0;
+        const TextQuad* quads = font->layout(text, quadsLen);
+
+        // A full page got wiped, pending quads still expect the old content
+        if (atlas->getGeneration() != generation) {
+            gfx.flush();
+        }
+
+        int y0 = 0;
+        int y1 = 0;
+        if (atlas->getDirtyRows(y0, y1)) 
+        {
+            const unsigned char* rows = atlas->getPixels() + y0*FontAtlas::PAGE_SIZE*4;
+            gfx.updateTextureRows(atlas->hTexture, y0, FontAtlas::PAGE_SIZE, y1-y0, rows);
+            atlas->clearDirty();
+        }
+
+        int hTexture = gfx.getTexture();
+        gfx.setTexture(atlas->hTexture);
+        for (int i=0; i<quadsLen; i++) 
+        {
+            const TextQuad& q = quads[i];
+            gfx.renderQuad(x + q.x*scale, y + q.y*scale, q.w*scale, q.h*scale, 
+                           q.tx, q.ty, q.tw, q.th, color);
+        }
+        gfx.setTexture(hTexture);
+    }
+
+    float measure(int hFont, const char* text)
+    {
+        if (hFont < 0 || hFont >= fontsLen) {
+            return 0.f;
+        }
+        return fonts[hFont]->measure(text);
+    }
+
+    // Measures the same as the font loadFont would make, but needs neither
+    // the atlas nor GL, so it can live on another thread
+    static FontMetrics* loadMetrics(const char* face, int pixelSize, int flags)
+    {
+        int upscale = (flags & FONT_SDF) != 0 ? SDF_UPSCALE : 1;
+        return new FontMetrics(new GdiGlyphRasterizer(face, pixelSize * upscale), upscale);
+    }
+
+private:
+    static const int SDF_UPSCALE = 4;
+
+    FontAtlas bitmapAtlas;
+    FontAtlas sdfAtlas;
+    Font* fonts[FONTS_MAX];
+    int fontsLen;
+};
+
+// Keeps the geometry of recently visible tilemap chunks in a fixed pool 
+// of static batches. A chunk is rebuilt only when its revision changes, 
+// and the least recently drawn one gives up its slot when the pool is full.
+struct TilemapRenderer
+{
+    static const int TILEMAPS_MAX = 16;
+
+    TilemapRenderer()
+        : tilemapsLen(0)
+        , useCounter(0)
+        , quads(new float[Tilemap::CHUNK_SIZE*Tilemap::CHUNK_SIZE*8])
+    {
+        for (int i=0; i<SLOTS_LEN; i++) 
+        {
+            slots[i].hTilemap = -1;
+            slots[i].hBatch = -1;
+            slots[i].quadsLen = 0;
+            slots[i].lastUse = 0;
+        }
+    }
+
+    ~TilemapRenderer()
+    {
+        for (int i=0; i<tilemapsLen; i++) {
+            delete tilemaps[i].map;
+        }
+        delete[] quads;
+    }
+
+    // Takes the lowest free handle, released ones included
+    int create(int hTexture, int w, int h, int tileSize, int atlasColumns, int atlasRows)
+    {
+        if (w <= 0 || h <= 0 || tileSize <= 0 || tileSize > Tilemap::TILE_SIZE_MAX
+            || atlasColumns <= 0 || atlasRows <= 0) 
+        {
+            return -1;
+        }
+        if (atlasColumns > Tilemap::TILES_MAX / atlasRows) {
+            return -1;
+        }
+
+        int hTilemap = 0;
+        while (hTilemap < tilemapsLen && tilemaps[hTilemap].map != NULL) {
+            hTilemap++;
+        }
+        if (hTilemap == TILEMAPS_MAX) {
+            return -1;
+        }
+
+        tilemaps[hTilemap].map = new Tilemap(w, h, tileSize, atlasColumns, atlasRows);
+        tilemaps[hTilemap].hTexture = hTexture;
+        if (hTilemap == tilemapsLen) {
+            tilemapsLen++;
+        }
+        return hTilemap;
+    }
+
+    // Frees the tiles, the map's chunk slots go first to the next chunks 
+    // that need one
+    void release(int hTilemap)
+    {
+        if (!isValid(hTilemap)) {
+            return;
+        }
+
+        delete tilemaps[hTilemap].map;
+        tilemaps[hTilemap].map = NULL;
+        for (int i=0; i<SLOTS_LEN; i++) 
+        {
+            ChunkSlot& slot = slots[i];
+            if (slot.hTilemap == hTilemap) 
+            {
+                slot.hTilemap = -1;
+                slot.quadsLen = 0;
+                slot.lastUse = 0;
+            }
+        }
+    }
+
+    void setTile(int hTilemap, int x, int y, int tile)
+    {
+        if (isValid(hTilemap)) {
+            tilemaps[hTilemap].map->setTile(x, y, tile);
+        }
+    }
+
+    // Draws the chunks overlapping the screen, scrolled so that map pixel 
+    // (scrollX, scrollY) lands in the top-left corner
+    void draw(Graphics& gfx, int hTilemap, float scrollX, float scrollY)
+    {
+        if (!isValid(hTilemap)) {
+            return;
+        }
+
+        const Tilemap& map = *tilemaps[hTilemap].map;
+        int screenW = 0;
+        int screenH = 0;
+        gfx.getScreenSize(screenW, screenH);
+
+        int cx0 = 0, cy0 = 0, cx1 = 0, cy1 = 0;
+        if (!map.getChunkRange(scrollX, scrollY, scrollX + screenW, scrollY + screenH, 
+                               cx0, cy0, cx1, cy1)) 
+        {
+            return;
+        }
+
+        float chunkPixels = (float)(Tilemap::CHUNK_SIZE * map.getTileSize());
+        for (int cy=cy0; cy<=cy1; cy++) {
+            for (int cx=cx0; cx<=cx1; cx++) 
+            {
+                const ChunkSlot& slot = getSlot(gfx, hTilemap, cx, cy);
+                if (slot.quadsLen > 0) {
+                    gfx.drawStaticBatch(slot.hBatch, cx*chunkPixels - scrollX, cy*chunkPixels - scrollY);
+                }
+            }
+        }
+    }
+
+private:
+    struct ChunkSlot
+    {
+        int hTilemap;
+        int cx;
+        int cy;
+        int revision;
+        int hBatch;
+        int quadsLen;
+        unsigned int lastUse;
+    };
+
+    bool isValid(int hTilemap) const
+    {
+        return hTilemap >= 0 && hTilemap < tilemapsLen && tilemaps[hTilemap].map != NULL;
+    }
+
+    const ChunkSlot& getSlot(Graphics& gfx, int hTilemap, int cx, int cy)
+    {
+        const TilemapEntry& entry = tilemaps[hTilemap];
+        int revision = entry.map->getChunkRevision(cx, cy);
+        useCounter++;
+
+        ChunkSlot* slot = NULL;
+        ChunkSlot* oldest = &slots[0];
+        for (int i=0; i<SLOTS_LEN && slot == NULL; i++) 
+        {
+            ChunkSlot& s = slots[i];
+            if (s.hTilemap == hTilemap && s.cx == cx && s.cy == cy) {
+                slot = &s;
+            } else if (s.lastUse < oldest->lastUse) {
+                oldest = &s;
+            }
+        }
+
+        if (slot != NULL && slot->revision == revision) 
+        {
+            slot->lastUse = useCounter;
+            return *slot;
+        }
+
+        if (slot == NULL) {
+            slot = oldest;
+        }
+
+        slot->hTilemap = hTilemap;
+        slot->cx = cx;
+        slot->cy = cy;
+        slot->revision = revision;
+        slot->lastUse = useCounter;
+        slot->quadsLen = entry.map->buildChunk(cx, cy, quads);
+
+        if (slot->quadsLen > 0) 
+        {
+            if (slot->hBatch < 0) {
+                slot->hBatch = gfx.addStaticBatch(entry.hTexture, quads, slot->quadsLen, true);
+            } else {
+                gfx.updateStaticBatch(slot->hBatch, entry.hTexture, quads, slot->quadsLen);
+            }
+            // Out of batches, draw nothing rather than somebody else's chunk
+            if (slot->hBatch < 0) {
+                slot->quadsLen = 0;
+            }
+        }
+
+        return *slot;
+    }
+
+    struct TilemapEntry
+    {
+        Tilemap* map;
+        int hTexture;
+    };
+
+    static const int SLOTS_LEN = Graphics::CHUNK_BATCHES_MAX;
+
+    TilemapEntry tilemaps[TILEMAPS_MAX];
+    int tilemapsLen;
+
+    ChunkSlot slots[SLOTS_LEN];
+    unsigned int useCounter;
+
+    float* quads;
+};
+
+}  // anonymous namespace
+
+struct RenderThread;
+
+struct SysAPI
+{
+    HWND window;
+    Graphics* gfx;
+    TextRenderer* text;
+    TilemapRenderer* tilemaps;
+    TraceRecorder* trace;
+
+    // Set through Sys_SetRedrawMode and Sys_RequestRedraw, read by the loop
+    int redrawMode;
+    int wakeMs;
+    bool redrawRequested;
+
+    // Kept up to date by the loop for Sys_GetRefreshRate and Sys_GetInterpolation
+    int refreshRate;
+    float interpolation;
+
+    // Set on the game's side when a render thread owns the backend, calls 
+    // are then only recorded into trace, which feeds the render thread
+    RenderThread* renderThread;
+
+    SysAPI(): window(NULL), gfx(NULL), text(NULL), tilemaps(NULL), trace(NULL)
+        , redrawMode(REDRAW_CONTINUOUS), wakeMs(0), redrawRequested(true)
+        , refreshRate(60), interpolation(0.f), renderThread(NULL)
+    {
+    }
+
+    SysAPI(HWND aWindow, Graphics* aGfx, TextRenderer* aText, 
+           TilemapRenderer* aTilemaps, TraceRecorder* aTrace)
+        : window(aWindow), gfx(aGfx), text(aText), tilemaps(aTilemaps), trace(aTrace)
+        , redrawMode(REDRAW_CONTINUOUS), wakeMs(0), redrawRequested(true)
+        , refreshRate(60), interpolation(0.f), renderThread(NULL)
+    {
+    }
 };
 
-}  // anonymous namespace
+// Owns the GL context and Graphics on a thread of its own. The game 
+// thread's Sys_* calls are recorded into a command queue in the trace 
+// format and replayed here against the backend SysAPI, so the game can 
+// work on the next frame while the driver still chews on the last one.
+struct RenderThread
+{
+public:
+    enum HandleKind
+    {
+        HANDLE_TEXTURE,
+        HANDLE_BATCH,
+        HANDLE_FONT,
+        HANDLE_TILEMAP,
+        HANDLE_KINDS_LEN,
+    };
+
+    RenderThread()
+        : queue(NULL)
+        , recorder(NULL)
+        , thread(NULL)
+        , frameDone(NULL)
+        , framesSubmitted(0)
+        , framesPresented(0)
+        , gpuTimingsValid(false)
+        , swapInterval(0)
+        , hasTargets(false)
+        , hasGpuTimers(false)
+        , hasSwapControl(false)
+        , hasSwapTear(false)
+    {
+        memset(&stats, 0, sizeof(stats));
+        memset(&gpuTimings, 0, sizeof(gpuTimings));
+        memset(handlesUsed, 0, sizeof(handlesUsed));
+        handlesMax[HANDLE_TEXTURE] = Graphics::TEXTURES_MAX;
+        handlesMax[HANDLE_BATCH] = Graphics::STATIC_BATCHES_MAX;
+        handlesMax[HANDLE_FONT] = TextRenderer::FONTS_MAX;
+        handlesMax[HANDLE_TILEMAP] = TilemapRenderer::TILEMAPS_MAX;
+        memset(fontMetrics, 0, sizeof(fontMetrics));
+    }
+
+    ~RenderThread()
+    {
+        for (int i=0; i<TextRenderer::FONTS_MAX; i++) {
+            delete fontMetrics[i];
+        }
+    }
+
+    // The context must not be current on the calling thread. backend 
+    // executes the calls, its trace (if any) records them to a file.
+    void start(HDC aDc, HGLRC aContext, const SysAPI& aBackend)
+    {
+        dc = aDc;
+        context = aContext;
+        backend = aBackend;
+        swapInterval = backend.gfx->getSwapInterval();
+
+        // Driver support is fixed once the context exists. Read it before
+        // the thread starts, so the game side can answer on its own.
+        hasTargets = backend.gfx->hasTargets();
+        hasGpuTimers = backend.gfx->hasGpuTimers();
+        hasSwapControl = backend.gfx->canSetSwapInterval(0);
+        hasSwapTear = backend.gfx->canSetSwapInterval(-1);
+
+        queue = new CommandQueue(QUEUE_SIZE_LOG2);
+        recorder = Trace_CreateQueueRecorder(queue);
+        InitializeCriticalSection(&statsLock);
+        frameDone = CreateEvent(NULL, FALSE, FALSE, NULL);
+        thread = CreateThread(NULL, 0, threadProc, this, 0, NULL);
+    }
+
+    // Lets the thread replay what's left and makes the context current 
+    // on the calling thread again
+    void stop()
+    {
+        Trace_ReleaseRecorder(recorder);
+        recorder = NULL;
+        WaitForSingleObject(thread, INFINITE);
+
+        CloseHandle(thread);
+        CloseHandle(frameDone);
+        DeleteCriticalSection(&statsLock);
+        delete queue;
+        queue = NULL;
+
+        wglMakeCurrent(dc, context);
+    }
+
+    TraceRecorder* getRecorder() const
+    {
+        return recorder;
+    }
+
+    const SysAPI& getBackend() const
+    {
+        return backend;
+    }
+
+    // Game side handles for calls that create something. The replay maps 
+    // them to whatever the backend returns. Released handles get reused
+    // lowest first, like the backend does with its slots, so a handle never
+    // goes past the backend's limit. Returns -1 when all are taken.
+    int allocHandle(HandleKind kind)
+    {
+        for (int h=0; h<handlesMax[kind]; h++) 
+        {
+            if (!handlesUsed[kind][h]) 
+            {
+                handlesUsed[kind][h] = true;
+                return h;
+            }
+        }
+        return -1;
+    }
+
+    void releaseHandle(HandleKind kind, int h)
+    {
+        if (h >= 0 && h < handlesMax[kind]) {
+            handlesUsed[kind][h] = false;
+        }
+    }
+
+    // The fonts live on the render thread, the game side measures text 
+    // with metrics of its own so it never has to wait for it
+    void loadFontMetrics(int hFont, const char* face, int pixelSize, int flags)
+    {
+        if (hFont >= 0 && hFont < TextRenderer::FONTS_MAX) 
+        {
+            delete fontMetrics[hFont];
+            fontMetrics[hFont] = TextRenderer::loadMetrics(face, pixelSize, flags);
+        }
+    }
+
+    // What the backend supports, as of start()
+    bool canCreateLayers() const
+    {
+        return hasTargets;
+    }
+
+    bool canTimeGpu() const
+    {
+        return hasGpuTimers;
+    }
+
+    bool canSetSwapInterval(int interval) const
+    {
+        return interval >= 0 ? hasSwapControl : hasSwapTear;
+    }
+
+    float measureText(int hFont, const char* text)
+    {
+        if (hFont < 0 || hFont >= TextRenderer::FONTS_MAX || fontMetrics[hFont] == NULL) {
+            return 0.f;
+        }
+        return fontMetrics[hFont]->measure(text);
+    }
+
+    // Called by the game thread after each frame, blocks while it's more
+    // than framesAhead frames ahead of the display
+    void waitForFrames(int framesAhead)
+    {
+        framesSubmitted++;
+        while ((LONG)framesSubmitted - InterlockedCompareExchange(&framesPresented, 0, 0) > framesAhead) {
+            WaitForSingleObject(frameDone, INFINITE);
+        }
+    }
+
+    void getStats(RenderStats* result)
+    {
+        EnterCriticalSection(&statsLock);
+        *result = stats;
+        LeaveCriticalSection(&statsLock);
+    }
+
+    bool getGpuTimings(GpuTimings* result)
+    {
+        EnterCriticalSection(&statsLock);
+        bool valid = gpuTimingsValid;
+        if (valid) {
+            *result = gpuTimings;
+        }
+        LeaveCriticalSection(&statsLock);
+        return valid;
+    }
+
+    // As of the last frame presented
+    int getSwapInterval()
+    {
+        EnterCriticalSection(&statsLock);
+        int result = swapInterval;
+        LeaveCriticalSection(&statsLock);
+        return result;
+    }
+
+private:
+    RenderThread(const RenderThread&);
+    RenderThread& operator=(const RenderThread&);
+
+    static DWORD WINAPI threadProc(void* user)
+    {
+        RenderThread* self = (RenderThread*)user;
+        wglMakeCurrent(self->dc, self->context);
+
+        TraceReplayHooks hooks = { self, replayResize, replayEndFrame };
+        Trace_ReplayQueue(self->queue, &self->backend, &hooks);
 
-struct SysAPI
-{
-    HWND window;
-    Graphics* gfx;
+        wglMakeCurrent(NULL, NULL);
+        return 0;
+    }
 
-    SysAPI(): window(NULL), gfx(NULL)
+    static void replayResize(void* user, int w, int h)
     {
+        RenderThread* self = (RenderThread*)user;
+        self->backend.gfx->setScreen(w, h);
+        Trace_Resize(self->backend.trace, w, h);
     }
 
-    SysAPI(HWND aWindow, Graphics* aGfx)
-        : window(aWindow), gfx(aGfx)
+    static int replayEndFrame(void* user)
     {
+        RenderThread* self = (RenderThread*)user;
+        Graphics& gfx = *self->backend.gfx;
+        gfx.endFrame();
+        SwapBuffers(self->dc);
+        Trace_EndFrame(self->backend.trace);
+
+        EnterCriticalSection(&self->statsLock);
+        self->stats = gfx.getStats();
+        self->gpuTimingsValid = gfx.getGpuTimings(self->gpuTimings);
+        self->swapInterval = gfx.getSwapInterval();
+        LeaveCriticalSection(&self->statsLock);
+
+        InterlockedIncrement(&self->framesPresented);
+        SetEvent(self->frameDone);
+        return 0;
     }
+
+    // Big enough for a few frames of quads, larger uploads stream through
+    static const int QUEUE_SIZE_LOG2 = 22;
+
+    HDC dc;
+    HGLRC context;
+    SysAPI backend;
+
+    CommandQueue* queue;
+    TraceRecorder* recorder;
+    HANDLE thread;
+
+    HANDLE frameDone;
+    unsigned int framesSubmitted;
+    volatile LONG framesPresented;
+
+    CRITICAL_SECTION statsLock;
+    RenderStats stats;
+    GpuTimings gpuTimings;
+    bool gpuTimingsValid;
+    int swapInterval;
+
+    bool hasTargets;
+    bool hasGpuTimers;
+    bool hasSwapControl;
+    bool hasSwapTear;
+
+    // The most any kind of handle has
+    static const int HANDLES_MAX = 256;
+    bool handlesUsed[HANDLE_KINDS_LEN][HANDLES_MAX];
+    int handlesMax[HANDLE_KINDS_LEN];
+
+    FontMetrics* fontMetrics[TextRenderer::FONTS_MAX];
 };
 
 namespace {
@@ -579,6 +2987,8 @@ public:
 
         ctx->gfx.init();
         ctx->gfx.setScreen(width, height);
+        // The swap paces rendering to the display, see run()
+        ctx->gfx.setSwapInterval(1);
 
         ctx->setMinClientSize(320, 200);
         int displayW = -1;
@@ -598,6 +3008,7 @@ public:
     ~Win32Window()
     {
         GameAPI_Release(game);
+        Trace_ReleaseRecorder(sys.trace);
 
         wglMakeCurrent(NULL, NULL);
         wglDeleteContext(mContext);
@@ -613,19 +3024,37 @@ public:
         mClassAtom = 0;
     }
 
-    void init()
+    // If tracePath is set, the Sys_* call stream gets recorded there. 
+    // threaded moves rendering to a thread of its own, see runThreaded().
+    void init(const char* tracePath, bool threaded)
     {
-        int refreshRate = getDisplayRefreshRate(mWindow);
-        mFrameTime = 1.f / (float)refreshRate;
-        mFrameTime -= 0.002f;
-        clamp(mFrameTime, 1/120.f, 1/30.f);
+        mSimStep = 1.f / (float)SIM_RATE;
 
         int clientWidth = -1;
         int clientHeight = -1;
         getClientSize(clientWidth, clientHeight);
-        sys = SysAPI(mWindow, &gfx);
+        TraceRecorder* trace = NULL;
+        if (tracePath != NULL) {
+            trace = Trace_CreateRecorder(tracePath);
+            Trace_Resize(trace, clientWidth, clientHeight);
+        }
+
+        sys = SysAPI(mWindow, &gfx, &text, &tilemaps, trace);
+        updateDisplayInfo();
+        if (threaded) 
+        {
+            // The render thread takes over the context and the recorder, 
+            // the game only talks to its queue
+            wglMakeCurrent(NULL, NULL);
+            renderThread.start(mDc, mContext, sys);
+            sys = SysAPI(mWindow, &gfx, &text, &tilemaps, renderThread.getRecorder());
+            sys.renderThread = &renderThread;
+            sys.refreshRate = renderThread.getBackend().refreshRate;
+            mWakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+            mThreaded = true;
+        }
         game = GameAPI_Create();
-        GameAPI_Init(game, &sys, clientWidth, clientHeight, mFrameTime);
+        GameAPI_Init(game, &sys, clientWidth, clientHeight, mSimStep);
     }
 
     void run()
@@ -635,46 +3064,213 @@ public:
         updateTimer.reset();
         updateTimeElapsed = 0.f;
 
+        // Frames at high refresh rates are shorter than the default 
+        // scheduler tick, Sleep needs a finer one
+        timeBeginPeriod(1);
+
         while (doCheckForExit() == false) 
         {
+            if (waitForEvents()) 
+            {
+                // Slept for an unknown time, catch up with a single update
+                updateTimer.reset();
+                updateTimeElapsed = mSimStep;
+            }
+
             frameTimer.getDeltaSeconds();
             doUpdateStep();
-            doRenderingStep();
+            if (sys.redrawMode == REDRAW_CONTINUOUS || sys.redrawRequested) {
+                doRenderingStep();
+            }
+
+            // With vsync the swap already waits for the display, sleeping
+            // on top of it would only add latency
+            int swapInterval = mThreaded ? renderThread.getSwapInterval() : gfx.getSwapInterval();
+            if (swapInterval == 0)
+            {
+                float sleepTime = mRefreshTime - 0.001f 
+                    - (float)frameTimer.getDeltaSeconds();
+                if (sleepTime > 0.f) {
+                    Sleep((DWORD)floor(sleepTime * 1000));
+                }
+            }
+        }
+
+        timeEndPeriod(1);
+    }
+
+    // The window thread only pumps messages here, forwarding resizes and 
+    // close requests, while run() goes on a game thread. Moving or sizing 
+    // the window blocks this thread only, frames keep coming.
+    void runThreaded()
+    {
+        HANDLE gameThread = CreateThread(NULL, 0, gameThreadProc, this, 0, NULL);
+
+        for (;;)
+        {
+            DWORD result = MsgWaitForMultipleObjects(1, &gameThread, FALSE, INFINITE, QS_ALLINPUT);
+            if (result == WAIT_OBJECT_0) {
+                break;
+            }
+
+            MSG msg;
+            while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE))
+            {
+                if (msg.message == WM_QUIT) {
+                    InterlockedIncrement(&mCloseRequests);
+                } else {
+                    TranslateMessage(&msg);
+                    DispatchMessage(&msg);
+                }
+            }
+
+            // An idle game loop may want to look at the new input
+            SetEvent(mWakeEvent);
+        }
 
-            float sleepTime = mFrameTime - 0.002f 
-                - (float)frameTimer.getDeltaSeconds();
-            if (sleepTime > 0.f) {
-                Sleep((DWORD)floor(sleepTime * 1000));
+        CloseHandle(gameThread);
+        CloseHandle(mWakeEvent);
+        renderThread.stop();
+
+        // Back to calling the backend directly, with the file recorder
+        sys = renderThread.getBackend();
+        mThreaded = false;
+    }
+
+    // Runs ticks updates back to back, not waiting for the clock, to 
+    // measure simulation throughput or soak test long sessions. Every 
+    // sampleEvery'th tick also renders a frame, 0 renders none. Rendering
+    // time doesn't count against the reported ticks per second.
+    void fastForward(int ticks, int sampleEvery)
+    {
+        // Messages are only pumped every so many ticks, they're not free
+        static const int POLL_TICKS = 256;
+
+        gfx.setSwapInterval(0);
+        sys.interpolation = 0.f;
+        mFastForward = true;
+
+        HighResTimer timer;
+        HighResTimer renderTimer;
+        double renderSeconds = 0.0;
+        int ticksDone = 0;
+        int frames = 0;
+        while (ticksDone < ticks && !doCheckForExit())
+        {
+            if (ticksDone % POLL_TICKS == 0) {
+                poll();
+            }
+            GameAPI_Update(game);
+            ticksDone++;
+
+            if (sampleEvery > 0 && ticksDone % sampleEvery == 0) 
+            {
+                renderTimer.reset();
+                GameAPI_Render(game);
+                gfx.endFrame();
+                SwapBuffers(mDc);
+                Trace_EndFrame(sys.trace);
+                renderSeconds += renderTimer.getDeltaSeconds();
+                frames++;
             }
         }
+        mFastForward = false;
+
+        double seconds = timer.getDeltaSeconds();
+        double simSeconds = seconds - renderSeconds;
+        char msg[256];
+        sprintf_s(msg, "fastforward: %d ticks in %.3f s, %.0f ticks/s, %d frames in %.3f s\n", 
+                  ticksDone, simSeconds, ticksDone / (simSeconds > 0.0 ? simSeconds : 1.0),
+                  frames, renderSeconds);
+        OutputDebugString(msg);
+    }
+
+    // Plays a recorded trace back without the game, as fast as possible
+    void replay(const char* tracePath)
+    {
+        gfx.setSwapInterval(0);
+
+        sys = SysAPI(mWindow, &gfx, &text, &tilemaps, NULL);
+        TraceReplayHooks hooks = { this, replayResize, replayEndFrame };
+
+        HighResTimer timer;
+        int frames = Trace_Replay(tracePath, &sys, &hooks);
+        double seconds = timer.getDeltaSeconds();
+
+        char msg[256];
+        if (frames < 0) 
+        {
+            sprintf_s(msg, "replay: %s is not a readable trace\n", tracePath);
+            OutputDebugString(msg);
+            return;
+        }
+        sprintf_s(msg, "replay: %d frames in %.3f s, %.1f fps\n", 
+                  frames, seconds, frames / (seconds > 0.0 ? seconds : 1.0));
+        OutputDebugString(msg);
+    }
+
+    void onSize(int newW, int newH)
+    {
+        if (mThreaded) 
+        {
+            // Picked up by poll() on the game thread
+            InterlockedExchange(&mPendingSize, MAKELONG(newW, newH));
+            SetEvent(mWakeEvent);
+            return;
+        }
+
+        doResize(newW, newH);
+        // Fast-forward only renders the frames it samples
+        if (!mFastForward) {
+            doRenderingStep();
+        }
     }
 
     void doResize(int newW, int newH)
     {
-        gfx.setScreen(newW, newH);
+        // The render thread resizes when it replays the record
+        if (!mThreaded) {
+            gfx.setScreen(newW, newH);
+        }
         GameAPI_Resize(game, newW, newH);
+        Trace_Resize(sys.trace, newW, newH);
     }
 
     void doUpdateStep()
     {
         poll();
 
+        // The simulation steps at a fixed rate, however fast frames are drawn
         updateTimeElapsed += (float)updateTimer.getDeltaSeconds();
         // Do no more than 3 updates, if more then something is wrong
-        for (int i=0; i<3 && updateTimeElapsed>mFrameTime; i++) {
+        for (int i=0; i<3 && updateTimeElapsed>mSimStep; i++) {
             GameAPI_Update(game);
-            updateTimeElapsed -= mFrameTime;
+            updateTimeElapsed -= mSimStep;
         }
-        clamp(updateTimeElapsed, 0.f, mFrameTime);
+        clamp(updateTimeElapsed, 0.f, mSimStep);
     }
 
     void doRenderingStep()
     {
-        if (IsIconic(mWindow) == 0) 
+        // No game means a replay owns the frame
+        if (game != NULL && IsIconic(mWindow) == 0) 
         {
+            // Requests made while rendering are for the next frame
+            sys.redrawRequested = false;
+            sys.interpolation = updateTimeElapsed / mSimStep;
             GameAPI_Render(game);
-            gfx.flush();
-            SwapBuffers(mDc);
+
+            if (mThreaded) 
+            {
+                Trace_EndFrame(sys.trace);
+                renderThread.waitForFrames(MAX_FRAMES_AHEAD);
+            } 
+            else 
+            {
+                gfx.endFrame();
+                SwapBuffers(mDc);
+                Trace_EndFrame(sys.trace);
+            }
         }
     }
 
@@ -683,15 +3279,73 @@ public:
         getWindowSize(mMinWidth, mMinHeight, w, h);
     }
 
+    void requestRedraw()
+    {
+        if (mThreaded) 
+        {
+            // Picked up by poll() on the game thread
+            InterlockedExchange(&mPendingRedraw, 1);
+            return;
+        }
+        sys.redrawRequested = true;
+    }
+
+    // Refresh rate of the display the window is on, called at start and 
+    // on display mode changes
+    void updateDisplayInfo()
+    {
+        mMonitor = MonitorFromWindow(mWindow, MONITOR_DEFAULTTONEAREST);
+        int refreshRate = getDisplayRefreshRate(mWindow);
+        if (mThreaded) 
+        {
+            InterlockedExchange(&mPendingRefreshRate, refreshRate);
+            return;
+        }
+        setRefreshRate(refreshRate);
+    }
+
+    void setRefreshRate(int refreshRate)
+    {
+        mRefreshTime = 1.f / (float)refreshRate;
+        sys.refreshRate = refreshRate;
+    }
+
+    void onMove()
+    {
+        // Still inside CreateWindowEx
+        if (mWindow == NULL) {
+            return;
+        }
+        if (MonitorFromWindow(mWindow, MONITOR_DEFAULTTONEAREST) != mMonitor) {
+            updateDisplayInfo();
+        }
+    }
+
 private:
     Win32Window()
-        : mFrameTime(0.f)
+        : mWindow(NULL)
+        , mSimStep(1.f / (float)SIM_RATE)
+        , mRefreshTime(1.f / 60.f)
+        , mMonitor(NULL)
         , mMinWidth(1)
         , mMinHeight(1)
+        , mThreaded(false)
+        , mWakeEvent(NULL)
+        , mPendingSize(-1)
+        , mPendingRedraw(0)
+        , mPendingRefreshRate(-1)
+        , mCloseRequests(0)
+        , mFastForward(false)
         , game(NULL)
     {
     }
 
+    static DWORD WINAPI gameThreadProc(void* user)
+    {
+        ((Win32Window*)user)->run();
+        return 0;
+    }
+
     void getClientSize(int& w, int& h)
     {
         RECT area;
@@ -725,6 +3379,60 @@ private:
         mMinHeight = h;
     }
 
+    static void replayResize(void* user, int w, int h)
+    {
+        ((Win32Window*)user)->gfx.setScreen(w, h);
+    }
+
+    static int replayEndFrame(void* user)
+    {
+        Win32Window* self = (Win32Window*)user;
+        self->gfx.endFrame();
+        SwapBuffers(self->mDc);
+
+        MSG msg;
+        while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE))
+        {
+            if (msg.message == WM_QUIT) {
+                return 1;
+            }
+            TranslateMessage(&msg);
+            DispatchMessage(&msg);
+        }
+        return 0;
+    }
+
+    // Blocks until a message arrives while there's nothing new to show: 
+    // minimized, rendering on demand with no redraw pending, or in the 
+    // background, where it also wakes up at a low rate. Returns true if 
+    // it had to wait.
+    bool waitForEvents()
+    {
+        static const DWORD BACKGROUND_FRAME_MS = 100;
+
+        DWORD timeout = 0;
+        if (IsIconic(mWindow)) {
+            timeout = INFINITE;
+        } else if (sys.redrawMode == REDRAW_ON_DEMAND && !sys.redrawRequested) {
+            timeout = sys.wakeMs > 0 ? (DWORD)sys.wakeMs : INFINITE;
+        } else if (GetForegroundWindow() != mWindow) {
+            timeout = BACKGROUND_FRAME_MS;
+        }
+
+        if (timeout == 0) {
+            return false;
+        }
+
+        if (mThreaded) {
+            // Set by the window thread for every batch of messages
+            WaitForSingleObject(mWakeEvent, timeout);
+        } else {
+            // Messages already peeked at but still queued count as well
+            MsgWaitForMultipleObjectsEx(0, NULL, timeout, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+        }
+        return true;
+    }
+
     bool doCheckForExit()
     {
         return GameAPI_Finished(game) == 1;
@@ -740,6 +3448,27 @@ private:
 
     void poll()
     {
+        if (mThreaded) 
+        {
+            LONG size = InterlockedExchange(&mPendingSize, -1);
+            if (size != -1) 
+            {
+                doResize(LOWORD(size), HIWORD(size));
+                sys.redrawRequested = true;
+            }
+            if (InterlockedExchange(&mPendingRedraw, 0) != 0) {
+                sys.redrawRequested = true;
+            }
+            LONG refreshRate = InterlockedExchange(&mPendingRefreshRate, -1);
+            if (refreshRate != -1) {
+                setRefreshRate(refreshRate);
+            }
+            for (LONG n = InterlockedExchange(&mCloseRequests, 0); n > 0; n--) {
+                GameAPI_OnClosing(game);
+            }
+            return;
+        }
+
         MSG msg;
         while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE))
         {
@@ -760,15 +3489,35 @@ private:
     HDC mDc;
     HGLRC mContext;
 
-    float mFrameTime;
+    static const int SIM_RATE = 60;
+    float mSimStep;
+    float mRefreshTime;
+    HMONITOR mMonitor;
     HighResTimer updateTimer;
     float updateTimeElapsed;
 
     int mMinWidth;
     int mMinHeight;
 
+    // Frames the game may queue up before waiting for the render thread
+    static const int MAX_FRAMES_AHEAD = 2;
+    bool mThreaded;
+    HANDLE mWakeEvent;
+    // Window thread to game thread handoff in threaded mode, -1 or 0 when
+    // there's nothing new
+    volatile LONG mPendingSize;
+    volatile LONG mPendingRedraw;
+    volatile LONG mPendingRefreshRate;
+    volatile LONG mCloseRequests;
+
+    bool mFastForward;
+
+    RenderThread renderThread;
+
     SysAPI sys;
     GameAPI* game;
+    TextRenderer text;
+    TilemapRenderer tilemaps;
     Graphics gfx;
 };
 
@@ -781,8 +3530,7 @@ static LRESULT CALLBACK wndProc(HWND   hwnd,
     
     switch (msg)
     {
-        // TODO: see if we really need to handle something else here, 
-        // like minimization and focus lost/gain
+        // Minimization and focus changes are picked up by the main loop
 
         case WM_CREATE:
         {
@@ -795,11 +3543,31 @@ static LRESULT CALLBACK wndProc(HWND   hwnd,
         {
             int w = LOWORD(lParam);
             int h = HIWORD(lParam);
-            window->doResize(w, h);
-            window->doRenderingStep();
+            window->onSize(w, h);
+            return 0;
+        }
+
+        case WM_PAINT:
+        {
+            // Uncovered parts get drawn with the next frame
+            ValidateRect(hwnd, NULL);
+            window->requestRedraw();
             return 0;
         }
 
+        case WM_MOVE:
+        {
+            // Monitors may differ in refresh rate
+            window->onMove();
+            break;
+        }
+
+        case WM_DISPLAYCHANGE:
+        {
+            window->updateDisplayInfo();
+            break;
+        }
+
         case WM_GETMINMAXINFO:
         {
             MINMAXINFO* mmi = (MINMAXINFO*)lParam;
@@ -823,20 +3591,65 @@ static LRESULT CALLBACK wndProc(HWND   hwnd,
 
 }  // anonymous namespace
 
+// With a render thread, calls from the game are only recorded. The render
+// thread replays them through these same functions on its own SysAPI.
+static bool isQueued(const SysAPI* sys)
+{
+    return sys->renderThread != NULL;
+}
+
 int Sys_LoadTexture(SysAPI* sys, const unsigned char* data, int w, int h)
 {
-    return sys->gfx->addTexture(data, w, h);
+    int hTexture = isQueued(sys) 
+        ? sys->renderThread->allocHandle(RenderThread::HANDLE_TEXTURE)
+        : sys->gfx->addTexture(data, w, h);
+    Trace_LoadTexture(sys->trace, hTexture, data, w, h);
+    return hTexture;
+}
+
+int Sys_LoadTextureEx(SysAPI* sys, const unsigned char* data, int w, int h, int format)
+{
+    int hTexture = isQueued(sys) 
+        ? sys->renderThread->allocHandle(RenderThread::HANDLE_TEXTURE)
+        : sys->gfx->addTexture(data, w, h, true, Graphics::SHADER_TEX, format);
+    Trace_LoadTextureEx(sys->trace, hTexture, data, w, h, format);
+    return hTexture;
+}
+
+void Sys_ReleaseTexture(SysAPI* sys, int hTexture)
+{
+    Trace_ReleaseTexture(sys->trace, hTexture);
+    if (isQueued(sys)) {
+        sys->renderThread->releaseHandle(RenderThread::HANDLE_TEXTURE, hTexture);
+    } else {
+        sys->gfx->releaseTexture(hTexture);
+    }
+}
+
+void Sys_SetTextureBudget(SysAPI* sys, int bytes)
+{
+    Trace_SetTextureBudget(sys->trace, bytes);
+    if (!isQueued(sys)) {
+        sys->gfx->setTextureBudget(bytes);
+    }
 }
 
 void Sys_SetTexture(SysAPI* sys, int hTexture)
 {
-    sys->gfx->setTexture(hTexture);
+    Trace_SetTexture(sys->trace, hTexture);
+    if (!isQueued(sys)) {
+        sys->gfx->setTexture(hTexture);
+    }
 }
 
 void Sys_ClearScreen(SysAPI* sys, float r, float g, float b)
 {
-    glClearColor(r, g, b, 1.f);
-    glClear(GL_COLOR_BUFFER_BIT);
+    Trace_ClearScreen(sys->trace, r, g, b);
+    if (!isQueued(sys)) 
+    {
+        glClearColor(r, g, b, 1.f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
 }
 
 void Sys_Render(SysAPI* sys, 
@@ -845,7 +3658,249 @@ void Sys_Render(SysAPI* sys,
                 float tx, float ty, 
                 float tw, float th)
 {
-    sys->gfx->renderQuad(sx, sy, sw, sh, tx, ty, tw, th);
+    Trace_Render(sys->trace, sx, sy, sw, sh, tx, ty, tw, th);
+    if (!isQueued(sys)) {
+        sys->gfx->renderQuad(sx, sy, sw, sh, tx, ty, tw, th);
+    }
+}
+
+void Sys_RenderEx(SysAPI* sys, 
+                  float sx, float sy, 
+                  float sw, float sh, 
+                  float tx, float ty, 
+                  float tw, float th,
+                  float pivotX, float pivotY,
+                  float rotation, float scaleX, float scaleY,
+                  unsigned int color)
+{
+    Trace_RenderEx(sys->trace, sx, sy, sw, sh, tx, ty, tw, th, 
+                   pivotX, pivotY, rotation, scaleX, scaleY, color);
+    if (!isQueued(sys)) {
+        sys->gfx->renderQuadEx(sx, sy, sw, sh, tx, ty, tw, th, 
+                               pivotX, pivotY, rotation, scaleX, scaleY, color);
+    }
+}
+
+void Sys_RenderAffine(SysAPI* sys, 
+                      const float* transform,
+                      float sx, float sy, 
+                      float sw, float sh, 
+                      float tx, float ty, 
+                      float tw, float th,
+                      unsigned int color)
+{
+    Trace_RenderAffine(sys->trace, transform, sx, sy, sw, sh, tx, ty, tw, th, color);
+    if (!isQueued(sys)) {
+        sys->gfx->renderQuadAffine(transform, sx, sy, sw, sh, tx, ty, tw, th, color);
+    }
+}
+
+void Sys_RenderDepth(SysAPI* sys, 
+                     float sx, float sy, 
+                     float sw, float sh, 
+                     float tx, float ty, 
+                     float tw, float th,
+                     float depth, int opaque)
+{
+    Trace_RenderDepth(sys->trace, sx, sy, sw, sh, tx, ty, tw, th, depth, opaque);
+    if (!isQueued(sys)) {
+        sys->gfx->renderQuadLayered(sx, sy, sw, sh, tx, ty, tw, th, depth, opaque != 0, 0xFFFFFFFF);
+    }
+}
+
+void Sys_FlushLayers(SysAPI* sys)
+{
+    Trace_FlushLayers(sys->trace);
+    if (!isQueued(sys)) {
+        sys->gfx->flushLayered();
+    }
+}
+
+int Sys_CreateLayer(SysAPI* sys, int w, int h)
+{
+    int hLayer = -1;
+    if (!isQueued(sys)) {
+        hLayer = sys->gfx->createTarget(w, h);
+    } else if (sys->renderThread->canCreateLayers()) {
+        hLayer = sys->renderThread->allocHandle(RenderThread::HANDLE_TEXTURE);
+    }
+    Trace_CreateLayer(sys->trace, hLayer, w, h);
+    return hLayer;
+}
+
+void Sys_BeginLayer(SysAPI* sys, int hLayer)
+{
+    Trace_BeginLayer(sys->trace, hLayer);
+    if (!isQueued(sys)) {
+        sys->gfx->beginTarget(hLayer);
+    }
+}
+
+void Sys_EndLayer(SysAPI* sys)
+{
+    Trace_EndLayer(sys->trace);
+    if (!isQueued(sys)) {
+        sys->gfx->endTarget();
+    }
+}
+
+int Sys_CreateStaticBatch(SysAPI* sys, int hTexture, const float* quads, int quadsLen)
+{
+    int hBatch = -1;
+    if (!isQueued(sys)) {
+        hBatch = sys->gfx->addStaticBatch(hTexture, quads, quadsLen);
+    } else if (quadsLen > 0) {
+        // Handles are reused like the backend's, so both run out at the same one
+        hBatch = sys->renderThread->allocHandle(RenderThread::HANDLE_BATCH);
+    }
+    Trace_CreateStaticBatch(sys->trace, hBatch, hTexture, quads, quadsLen);
+    return hBatch;
+}
+
+void Sys_ReleaseStaticBatch(SysAPI* sys, int hBatch)
+{
+    // The chunk pool behind them belongs to the tilemaps
+    if (hBatch < 0 || hBatch >= Graphics::STATIC_BATCHES_MAX) {
+        return;
+    }
+
+    Trace_ReleaseStaticBatch(sys->trace, hBatch);
+    if (isQueued(sys)) {
+        sys->renderThread->releaseHandle(RenderThread::HANDLE_BATCH, hBatch);
+    } else {
+        sys->gfx->releaseStaticBatch(hBatch);
+    }
+}
+
+void Sys_DrawStaticBatch(SysAPI* sys, int hBatch, float dx, float dy)
+{
+    Trace_DrawStaticBatch(sys->trace, hBatch, dx, dy);
+    if (!isQueued(sys)) {
+        sys->gfx->drawStaticBatch(hBatch, dx, dy);
+    }
+}
+
+int Sys_CreateTilemap(SysAPI* sys, int hTexture, int w, int h, int tileSize, 
+                      int atlasColumns, int atlasRows)
+{
+    int hTilemap = isQueued(sys) 
+        ? sys->renderThread->allocHandle(RenderThread::HANDLE_TILEMAP)
+        : sys->tilemaps->create(hTexture, w, h, tileSize, atlasColumns, atlasRows);
+    Trace_CreateTilemap(sys->trace, hTilemap, hTexture, w, h, tileSize, atlasColumns, atlasRows);
+    return hTilemap;
+}
+
+void Sys_ReleaseTilemap(SysAPI* sys, int hTilemap)
+{
+    Trace_ReleaseTilemap(sys->trace, hTilemap);
+    if (isQueued(sys)) {
+        sys->renderThread->releaseHandle(RenderThread::HANDLE_TILEMAP, hTilemap);
+    } else {
+        sys->tilemaps->release(hTilemap);
+    }
+}
+
+void Sys_SetTile(SysAPI* sys, int hTilemap, int x, int y, int tile)
+{
+    Trace_SetTile(sys->trace, hTilemap, x, y, tile);
+    if (!isQueued(sys)) {
+        sys->tilemaps->setTile(hTilemap, x, y, tile);
+    }
+}
+
+void Sys_DrawTilemap(SysAPI* sys, int hTilemap, float scrollX, float scrollY)
+{
+    Trace_DrawTilemap(sys->trace, hTilemap, scrollX, scrollY);
+    if (!isQueued(sys)) {
+        sys->tilemaps->draw(*sys->gfx, hTilemap, scrollX, scrollY);
+    }
+}
+
+int Sys_LoadFont(SysAPI* sys, const char* face, int pixelSize, int flags)
+{
+    int hFont = -1;
+    if (!isQueued(sys)) {
+        hFont = sys->text->loadFont(*sys->gfx, face, pixelSize, flags);
+    } else {
+        hFont = sys->renderThread->allocHandle(RenderThread::HANDLE_FONT);
+        sys->renderThread->loadFontMetrics(hFont, face, pixelSize, flags);
+    }
+    Trace_LoadFont(sys->trace, hFont, face, pixelSize, flags);
+    return hFont;
+}
+
+void Sys_RenderText(SysAPI* sys, int hFont, float x, float y, float scale, 
+                    unsigned int color, const char* text)
+{
+    Trace_RenderText(sys->trace, hFont, x, y, scale, color, text);
+    if (!isQueued(sys)) {
+        sys->text->render(*sys->gfx, hFont, x, y, scale, color, text);
+    }
+}
+
+float Sys_MeasureText(SysAPI* sys, int hFont, const char* text)
+{
+    if (isQueued(sys)) {
+        return sys->renderThread->measureText(hFont, text);
+    }
+    return sys->text->measure(hFont, text);
+}
+
+int Sys_EnableGpuTimers(SysAPI* sys, int enable)
+{
+    Trace_EnableGpuTimers(sys->trace, enable);
+    if (isQueued(sys)) {
+        return enable == 0 || sys->renderThread->canTimeGpu() ? 1 : 0;
+    }
+    return sys->gfx->setGpuTimers(enable != 0) ? 1 : 0;
+}
+
+int Sys_GetGpuTimings(SysAPI* sys, GpuTimings* timings)
+{
+    if (isQueued(sys)) {
+        return sys->renderThread->getGpuTimings(timings) ? 1 : 0;
+    }
+    return sys->gfx->getGpuTimings(*timings) ? 1 : 0;
+}
+
+void Sys_SetRedrawMode(SysAPI* sys, int mode, int wakeMs)
+{
+    sys->redrawMode = mode;
+    sys->wakeMs = wakeMs;
+    sys->redrawRequested = true;
+}
+
+void Sys_RequestRedraw(SysAPI* sys)
+{
+    sys->redrawRequested = true;
+}
+
+int Sys_SetSwapInterval(SysAPI* sys, int interval)
+{
+    Trace_SetSwapInterval(sys->trace, interval);
+    if (isQueued(sys)) {
+        return sys->renderThread->canSetSwapInterval(interval) ? 1 : 0;
+    }
+    return sys->gfx->setSwapInterval(interval) ? 1 : 0;
+}
+
+int Sys_GetRefreshRate(SysAPI* sys)
+{
+    return sys->refreshRate;
+}
+
+float Sys_GetInterpolation(SysAPI* sys)
+{
+    return sys->interpolation;
+}
+
+void Sys_GetRenderStats(SysAPI* sys, RenderStats* stats)
+{
+    if (isQueued(sys)) {
+        sys->renderThread->getStats(stats);
+        return;
+    }
+    *stats = sys->gfx->getStats();
 }
 
 int Sys_GetMouseButtonState(SysAPI* sys)
@@ -862,6 +3917,7 @@ int Sys_GetMouseButtonState(SysAPI* sys)
             ? KEY_MAPPING[i+1] : 0;
         i++;
     }
+    Trace_MouseButtonState(sys->trace, result);
     return result;
 }
 
@@ -872,13 +3928,37 @@ void Sys_GetMousePos(SysAPI* sys, int* x, int* y)
     ScreenToClient(sys->window, &coords);
     *x = coords.x;
     *y = coords.y;
+    Trace_MousePos(sys->trace, coords.x, coords.y);
 }
 
-int WINAPI WinMain(HINSTANCE, HINSTANCE, LPSTR, int)
+// Command line options:
+//   -record <path>  record the Sys_* call stream into a trace
+//   -replay <path>  play a recorded trace back instead of running the game
+//   -renderthread   render on a thread of its own, fed by the game thread
+//   -fastforward <ticks>  run that many updates as fast as possible, then 
+//                   quit, rendering every -sample <ticks> if given
+int WINAPI WinMain(HINSTANCE, HINSTANCE, LPSTR cmdLine, int)
 {
+    char tracePath[MAX_PATH];
     Win32Window* window = Win32Window::open(640, 480, "My window");
-    window->init();
-    window->run();
+    if (getCmdArg(cmdLine, "-replay", tracePath, sizeof(tracePath))) {
+        window->replay(tracePath);
+    } else {
+        bool record = getCmdArg(cmdLine, "-record", tracePath, sizeof(tracePath));
+        char ticksArg[32];
+        char sampleArg[32];
+        bool fastForward = getCmdArg(cmdLine, "-fastforward", ticksArg, sizeof(ticksArg));
+        bool threaded = !fastForward && strstr(cmdLine, "-renderthread") != NULL;
+        window->init(record ? tracePath : NULL, threaded);
+        if (fastForward) {
+            bool sample = getCmdArg(cmdLine, "-sample", sampleArg, sizeof(sampleArg));
+            window->fastForward(atoi(ticksArg), sample ? atoi(sampleArg) : 0);
+        } else if (threaded) {
+            window->runThreaded();
+        } else {
+            window->run();
+        }
+    }
 
     delete window;
 
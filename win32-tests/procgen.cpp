@@ -0,0 +1,572 @@
+﻿#define _CRT_SECURE_NO_WARNINGS
+#include <windows.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define PROCGEN_SSE2
+#endif
+
+#include "procgen.h"
+
+namespace {
+
+// Part of the hash, bump it when a kernel changes so that results cached
+// by the old one stop matching
+const unsigned int PROCGEN_VERSION = 1;
+const char CACHE_MAGIC[4] = { 'P', 'G', 'E', 'N' };
+
+// Rows are handed out to workers in blocks of this many
+const int ROWS_PER_BLOCK = 16;
+const int WORKERS_MAX = 8;
+
+const int CELLS_MAX = 4096;
+const int OCTAVES_MAX = 12;
+
+// Unit gradients in eight directions
+const float GRAD_X[8] = { 1.f, 0.7071068f, 0.f, -0.7071068f, -1.f, -0.7071068f,  0.f,  0.7071068f };
+const float GRAD_Y[8] = { 0.f, 0.7071068f, 1.f,  0.7071068f,  0.f, -0.7071068f, -1.f, -0.7071068f };
+
+// Perlin noise stays within this of 0 with unit gradients
+const float PERLIN_SCALE = 0.7071068f;
+
+unsigned int hashLattice(int i, int j, unsigned int seed)
+{
+    unsigned int h = (unsigned int)i*0x8DA6B343u ^ (unsigned int)j*0xD8163841u ^ seed*0xCB1AB31Fu;
+    h ^= h >> 13;
+    h *= 0x5BD1E995u;
+    h ^= h >> 15;
+    return h;
+}
+
+float fade(float t)
+{
+    return t*t*t*(t*(t*6.f - 15.f) + 10.f);
+}
+
+template <class T>
+T clampValue(T value, T min, T max)
+{
+    return value < min ? min : (value > max ? max : value);
+}
+
+// Row buffers of one worker
+struct Scratch
+{
+    Scratch(int w, int cellsMax)
+        : field(new float[w])
+        , slopes(new float[cellsMax+1])
+        , offsets(new float[cellsMax+1])
+    {
+    }
+
+    ~Scratch()
+    {
+        delete[] field;
+        delete[] slopes;
+        delete[] offsets;
+    }
+
+    float* field;
+    // Noise of the current row next to lattice column i is 
+    // slopes[i]*dx + offsets[i], dx being the distance to the column
+    float* slopes;
+    float* offsets;
+
+private:
+    Scratch(const Scratch&);
+    Scratch& operator=(const Scratch&);
+};
+
+struct Job
+{
+    ProcGenParams params;
+    unsigned char* dst;
+    // Palette in texel byte order
+    unsigned int palette[256];
+    bool hasPalette;
+    int cellsMax;
+    int blocksLen;
+    volatile LONG nextBlock;
+};
+
+void fillGradientRow(const ProcGenParams& p, int y, float* field)
+{
+    float dx = p.x1 - p.x0;
+    float dy = p.y1 - p.y0;
+    float len2 = dx*dx + dy*dy;
+    if (len2 <= 0.f) 
+    {
+        memset(field, 0, p.w*sizeof(float));
+        return;
+    }
+
+    // Texel centers project onto the gradient's axis
+    float v = ((float)y + 0.5f) / p.h;
+    float base = ((0.5f/p.w - p.x0)*dx + (v - p.y0)*dy) / len2;
+    float step = dx / (p.w*len2);
+
+    int x = 0;
+#ifdef PROCGEN_SSE2
+    __m128 vStep4 = _mm_set1_ps(step*4.f);
+    __m128 vValue = _mm_add_ps(_mm_set1_ps(base), 
+                               _mm_mul_ps(_mm_set_ps(3.f, 2.f, 1.f, 0.f), _mm_set1_ps(step)));
+    for (; x+4 <= p.w; x+=4) 
+    {
+        _mm_storeu_ps(field + x, vValue);
+        vValue = _mm_add_ps(vValue, vStep4);
+    }
+#endif
+    for (; x<p.w; x++) {
+        field[x] = base + x*step;
+    }
+}
+
+// Adds one octave of noise, scaled to [0, 1] and then by amp. The row's 
+// vertical interpolation is done once per lattice column, leaving a 1D 
+// interpolation between neighbouring columns for each texel.
+void addNoiseRow(const ProcGenParams& p, int y, int cells, unsigned int seed, float amp, 
+                 Scratch& scratch)
+{
+    float sy = ((float)y + 0.5f) * cells / p.h;
+    int j = (int)sy;
+    float v = sy - j;
+    float fv = fade(v);
+    int j0 = j % cells;
+    int j1 = (j+1) % cells;
+
+    float* slopes = scratch.slopes;
+    float* offsets = scratch.offsets;
+    float scale = 0.f;
+    float bias = 0.f;
+    if (p.kind == PROCGEN_VALUE_NOISE) 
+    {
+        // Values are flat, dx doesn't matter
+        for (int i=0; i<=cells; i++)
+        {
+            float a = (float)(hashLattice(i % cells, j0, seed) & 0xFFFFFF) * (1.f/16777215.f);
+            float b = (float)(hashLattice(i % cells, j1, seed) & 0xFFFFFF) * (1.f/16777215.f);
+            slopes[i] = 0.f;
+            offsets[i] = a + (b - a)*fv;
+        }
+        scale = amp;
+    }
+    else
+    {
+        // Dot products with the corner gradients, top and bottom blended
+        for (int i=0; i<=cells; i++)
+        {
+            unsigned int g0 = hashLattice(i % cells, j0, seed) & 7;
+            unsigned int g1 = hashLattice(i % cells, j1, seed) & 7;
+            float top = GRAD_Y[g0]*v;
+            float bottom = GRAD_Y[g1]*(v - 1.f);
+            slopes[i] = GRAD_X[g0] + (GRAD_X[g1] - GRAD_X[g0])*fv;
+            offsets[i] = top + (bottom - top)*fv;
+        }
+        scale = amp*PERLIN_SCALE;
+        bias = amp*0.5f;
+    }
+
+    float* field = scratch.field;
+    float cellsPerTexel = (float)cells / p.w;
+    int x = 0;
+#ifdef PROCGEN_SSE2
+    __m128 vCellsPerTexel = _mm_set1_ps(cellsPerTexel);
+    __m128 vScale = _mm_set1_ps(scale);
+    __m128 vBias = _mm_set1_ps(bias);
+    __m128 vOne = _mm_set1_ps(1.f);
+    for (; x+4 <= p.w; x+=4)
+    {
+        float fx = (float)x;
+        __m128 s = _mm_mul_ps(_mm_set_ps(fx+3.5f, fx+2.5f, fx+1.5f, fx+0.5f), vCellsPerTexel);
+        __m128i vi = _mm_cvttps_epi32(s);
+        __m128 u = _mm_sub_ps(s, _mm_cvtepi32_ps(vi));
+
+        int i[4];
+        _mm_storeu_si128((__m128i*)i, vi);
+        __m128 slope0 = _mm_set_ps(slopes[i[3]], slopes[i[2]], slopes[i[1]], slopes[i[0]]);
+        __m128 offset0 = _mm_set_ps(offsets[i[3]], offsets[i[2]], offsets[i[1]], offsets[i[0]]);
+        __m128 slope1 = _mm_set_ps(slopes[i[3]+1], slopes[i[2]+1], slopes[i[1]+1], slopes[i[0]+1]);
+        __m128 offset1 = _mm_set_ps(offsets[i[3]+1], offsets[i[2]+1], offsets[i[1]+1], offsets[i[0]+1]);
+
+        __m128 left = _mm_add_ps(_mm_mul_ps(slope0, u), offset0);
+        __m128 right = _mm_add_ps(_mm_mul_ps(slope1, _mm_sub_ps(u, vOne)), offset1);
+
+        // fade(u) = u^3 * (u*(u*6 - 15) + 10)
+        __m128 f = _mm_sub_ps(_mm_mul_ps(u, _mm_set1_ps(6.f)), _mm_set1_ps(15.f));
+        f = _mm_add_ps(_mm_mul_ps(f, u), _mm_set1_ps(10.f));
+        f = _mm_mul_ps(f, _mm_mul_ps(u, _mm_mul_ps(u, u)));
+
+        __m128 n = _mm_add_ps(left, _mm_mul_ps(_mm_sub_ps(right, left), f));
+        n = _mm_add_ps(_mm_mul_ps(n, vScale), vBias);
+        _mm_storeu_ps(field + x, _mm_add_ps(_mm_loadu_ps(field + x), n));
+    }
+#endif
+    for (; x<p.w; x++)
+    {
+        float s = ((float)x + 0.5f) * cellsPerTexel;
+        int i = (int)s;
+        float u = s - i;
+        float left = slopes[i]*u + offsets[i];
+        float right = slopes[i+1]*(u - 1.f) + offsets[i+1];
+        float n = left + (right - left)*fade(u);
+        field[x] += n*scale + bias;
+    }
+}
+
+// Maps the field to palette indices and writes RGBA8 texels
+void packRow(const Job& job, const float* field, unsigned int* dst)
+{
+    int w = job.params.w;
+    int x = 0;
+#ifdef PROCGEN_SSE2
+    __m128 vZero = _mm_setzero_ps();
+    __m128 vOne = _mm_set1_ps(1.f);
+    __m128 v255 = _mm_set1_ps(255.f);
+    __m128 vHalf = _mm_set1_ps(0.5f);
+    __m128i vAlpha = _mm_set1_epi32((int)0xFF000000);
+    for (; x+4 <= w; x+=4)
+    {
+        __m128 t = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(field + x), vZero), vOne);
+        __m128i index = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(t, v255), vHalf));
+        if (job.hasPalette) 
+        {
+            int i[4];
+            _mm_storeu_si128((__m128i*)i, index);
+            dst[x+0] = job.palette[i[0]];
+            dst[x+1] = job.palette[i[1]];
+            dst[x+2] = job.palette[i[2]];
+            dst[x+3] = job.palette[i[3]];
+        } 
+        else 
+        {
+            // Grey, the index in red, green and blue
+            __m128i grey = _mm_or_si128(index, _mm_slli_epi32(index, 8));
+            grey = _mm_or_si128(grey, _mm_slli_epi32(index, 16));
+            _mm_storeu_si128((__m128i*)(dst + x), _mm_or_si128(grey, vAlpha));
+        }
+    }
+#endif
+    for (; x<w; x++)
+    {
+        float t = clampValue(field[x], 0.f, 1.f);
+        unsigned int index = (unsigned int)(t*255.f + 0.5f);
+        dst[x] = job.hasPalette ? job.palette[index] : (index * 0x010101u) | 0xFF000000u;
+    }
+}
+
+void generateRow(const Job& job, int y, Scratch& scratch)
+{
+    const ProcGenParams& p = job.params;
+    float* field = scratch.field;
+
+    if (p.kind == PROCGEN_GRADIENT) 
+    {
+        fillGradientRow(p, y, field);
+    } 
+    else 
+    {
+        memset(field, 0, p.w*sizeof(float));
+        float amp = 1.f;
+        float ampSum = 0.f;
+        for (int k=0; k<p.octaves; k++)
+        {
+            addNoiseRow(p, y, p.cells << k, p.seed + k, amp, scratch);
+            ampSum += amp;
+            amp *= p.persistence;
+        }
+
+        if (ampSum > 0.f) 
+        {
+            float norm = 1.f / ampSum;
+            for (int x=0; x<p.w; x++) {
+                field[x] *= norm;
+            }
+        }
+    }
+
+    packRow(job, field, (unsigned int*)(job.dst + (size_t)y*p.w*4));
+}
+
+void generateBlocks(Job& job)
+{
+    Scratch scratch(job.params.w, job.cellsMax);
+    for (;;)
+    {
+        int block = (int)InterlockedIncrement(&job.nextBlock) - 1;
+        if (block >= job.blocksLen) {
+            break;
+        }
+
+        int y1 = clampValue((block+1)*ROWS_PER_BLOCK, 0, job.params.h);
+        for (int y=block*ROWS_PER_BLOCK; y<y1; y++) {
+            generateRow(job, y, scratch);
+        }
+    }
+}
+
+DWORD WINAPI workerProc(void* user)
+{
+    generateBlocks(*(Job*)user);
+    return 0;
+}
+
+// Palette colors come as 0xRRGGBBAA, texels are R, G, B, A in memory
+unsigned int toTexel(unsigned int color)
+{
+    return (color >> 24) | ((color >> 8) & 0xFF00) 
+        | ((color << 8) & 0xFF0000) | ((color & 0xFF) << 24);
+}
+
+// FNV-1a
+void hashBytes(unsigned int& hash, const void* data, size_t size)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i=0; i<size; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+}
+
+// Everything the output depends on. Cache files are named by its hash 
+// and store it in full, so a hash collision is a miss, not another texture.
+struct CacheKey
+{
+    unsigned int version;
+    int kind;
+    int w;
+    int h;
+    float x0, y0, x1, y1;
+    int cells;
+    int octaves;
+    float persistence;
+    unsigned int seed;
+    int hasPalette;
+    unsigned int palette[256];
+};
+
+void makeCacheKey(const ProcGenParams& p, CacheKey& key)
+{
+    memset(&key, 0, sizeof(key));
+    key.version = PROCGEN_VERSION;
+    key.kind = p.kind;
+    key.w = p.w;
+    key.h = p.h;
+    key.x0 = p.x0;
+    key.y0 = p.y0;
+    key.x1 = p.x1;
+    key.y1 = p.y1;
+    key.cells = p.cells;
+    key.octaves = p.octaves;
+    key.persistence = p.persistence;
+    key.seed = p.seed;
+    key.hasPalette = p.palette != NULL ? 1 : 0;
+    if (key.hasPalette) {
+        memcpy(key.palette, p.palette, sizeof(key.palette));
+    }
+}
+
+struct CacheHeader
+{
+    char magic[4];
+    CacheKey key;
+};
+
+// Relative cache dirs are taken from the executable's directory rather 
+// than the working directory. Returns false if the paths don't fit.
+bool getCachePaths(const char* cacheDir, unsigned int hash, 
+                   char (&dir)[MAX_PATH], char (&path)[MAX_PATH])
+{
+    static const size_t FILE_NAME_LEN = 14;
+
+    bool absolute = cacheDir[0] == '\\' || cacheDir[0] == '/' 
+        || (cacheDir[0] != '\0' && cacheDir[1] == ':');
+    if (absolute) 
+    {
+        if (strlen(cacheDir) + FILE_NAME_LEN >= MAX_PATH) {
+            return false;
+        }
+        sprintf_s(dir, "%s", cacheDir);
+    } 
+    else 
+    {
+        char exeDir[MAX_PATH];
+        DWORD len = GetModuleFileName(NULL, exeDir, MAX_PATH);
+        if (len == 0 || len >= MAX_PATH) {
+            return false;
+        }
+        char* slash = strrchr(exeDir, '\\');
+        if (slash != NULL) {
+            *slash = '\0';
+        }
+        if (strlen(exeDir) + 1 + strlen(cacheDir) + FILE_NAME_LEN >= MAX_PATH) {
+            return false;
+        }
+        sprintf_s(dir, "%s\\%s", exeDir, cacheDir);
+    }
+
+    sprintf_s(path, "%s\\%08x.pgen", dir, hash);
+    return true;
+}
+
+bool loadCached(const char* path, const ProcGenParams& p, const CacheKey& key, unsigned char* dst)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+
+    CacheHeader header;
+    size_t size = (size_t)p.w*p.h*4;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1
+        && memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0
+        && memcmp(&header.key, &key, sizeof(key)) == 0
+        && fread(dst, 1, size, file) == size;
+    fclose(file);
+    return ok;
+}
+
+// A file left incomplete fails the size check on load and gets rewritten
+void storeCached(const char* path, const ProcGenParams& p, const CacheKey& key, const unsigned char* data)
+{
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        return;
+    }
+
+    CacheHeader header;
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.key = key;
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(data, 1, (size_t)p.w*p.h*4, file);
+    fclose(file);
+}
+
+}  // anonymous namespace
+
+void ProcGen_InitParams(ProcGenParams* params, int kind, int w, int h)
+{
+    memset(params, 0, sizeof(*params));
+    params->kind = kind;
+    params->w = w;
+    params->h = h;
+    params->x1 = 1.f;
+    params->cells = 4;
+    params->octaves = 1;
+    params->persistence = 0.5f;
+}
+
+void ProcGen_MakePalette(const unsigned int* colors, const float* positions, int stopsLen, 
+                         unsigned int* palette)
+{
+    int stop = 0;
+    for (int i=0; i<256; i++)
+    {
+        float t = i / 255.f;
+        while (stop+1 < stopsLen && positions[stop+1] <= t) {
+            stop++;
+        }
+
+        if (stop+1 >= stopsLen || positions[stop+1] <= positions[stop] || t <= positions[stop]) 
+        {
+            palette[i] = colors[stop];
+            continue;
+        }
+
+        // Per channel blend between the two stops around t
+        float f = (t - positions[stop]) / (positions[stop+1] - positions[stop]);
+        unsigned int a = colors[stop];
+        unsigned int b = colors[stop+1];
+        unsigned int result = 0;
+        for (int shift=0; shift<32; shift+=8)
+        {
+            float ca = (float)((a >> shift) & 0xFF);
+            float cb = (float)((b >> shift) & 0xFF);
+            result |= (unsigned int)(ca + (cb - ca)*f + 0.5f) << shift;
+        }
+        palette[i] = result;
+    }
+}
+
+unsigned int ProcGen_Hash(const ProcGenParams* params)
+{
+    CacheKey key;
+    makeCacheKey(*params, key);
+    unsigned int hash = 2166136261u;
+    hashBytes(hash, &key, sizeof(key));
+    return hash;
+}
+
+void ProcGen_Generate(const ProcGenParams* params, unsigned char* dst)
+{
+    if (params->w <= 0 || params->h <= 0) {
+        return;
+    }
+
+    Job* job = new Job;
+    job->params = *params;
+    job->dst = dst;
+    job->hasPalette = params->palette != NULL;
+    if (job->hasPalette) 
+    {
+        for (int i=0; i<256; i++) {
+            job->palette[i] = toTexel(params->palette[i]);
+        }
+    }
+
+    // Octaves finer than a texel would only alias
+    ProcGenParams& p = job->params;
+    p.cells = clampValue(p.cells, 1, CELLS_MAX);
+    p.octaves = clampValue(p.octaves, 1, OCTAVES_MAX);
+    while (p.octaves > 1 && (p.cells << (p.octaves-1)) > p.w) {
+        p.octaves--;
+    }
+    job->cellsMax = p.cells << (p.octaves-1);
+    job->blocksLen = (p.h + ROWS_PER_BLOCK-1) / ROWS_PER_BLOCK;
+    job->nextBlock = 0;
+
+    // The calling thread works too
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    int workersLen = clampValue((int)info.dwNumberOfProcessors - 1, 0, WORKERS_MAX);
+    workersLen = clampValue(workersLen, 0, job->blocksLen - 1);
+
+    HANDLE workers[WORKERS_MAX];
+    for (int i=0; i<workersLen; i++) {
+        workers[i] = CreateThread(NULL, 0, workerProc, job, 0, NULL);
+    }
+    generateBlocks(*job);
+    if (workersLen > 0) {
+        WaitForMultipleObjects(workersLen, workers, TRUE, INFINITE);
+    }
+    for (int i=0; i<workersLen; i++) {
+        CloseHandle(workers[i]);
+    }
+
+    delete job;
+}
+
+bool ProcGen_GenerateCached(const ProcGenParams* params, unsigned char* dst, const char* cacheDir)
+{
+    CacheKey key;
+    makeCacheKey(*params, key);
+    unsigned int hash = ProcGen_Hash(params);
+
+    char dir[MAX_PATH];
+    char path[MAX_PATH];
+    if (!getCachePaths(cacheDir, hash, dir, path)) 
+    {
+        ProcGen_Generate(params, dst);
+        return false;
+    }
+
+    if (loadCached(path, *params, key, dst)) {
+        return true;
+    }
+
+    ProcGen_Generate(params, dst);
+    CreateDirectory(dir, NULL);
+    storeCached(path, *params, key, dst);
+    return false;
+}
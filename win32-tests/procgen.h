@@ -0,0 +1,53 @@
+﻿#pragma once
+
+// Procedural RGBA8 textures: a scalar field made of a gradient or 
+// octaves of noise, mapped through a palette. Rows are generated four 
+// texels at a time where SSE2 is available, split over worker threads.
+
+enum ProcGenKind
+{
+    PROCGEN_GRADIENT     = 0,
+    PROCGEN_VALUE_NOISE  = 1,
+    PROCGEN_PERLIN_NOISE = 2,
+};
+
+struct ProcGenParams
+{
+    int kind;
+    int w;
+    int h;
+
+    // Gradient from 0 at (x0, y0) to 1 at (x1, y1), in texture space 
+    // where (1, 1) is the bottom-right corner
+    float x0, y0, x1, y1;
+
+    // Noise: lattice cells across the texture for the first octave, each 
+    // next octave has twice as many and persistence times the amplitude.
+    // The lattice wraps, so noise textures tile.
+    int cells;
+    int octaves;
+    float persistence;
+    unsigned int seed;
+
+    // 256 colors packed as 0xRRGGBBAA the field indexes, grey if NULL
+    const unsigned int* palette;
+};
+
+// Defaults: a horizontal gradient, 4 cells, 1 octave, persistence 0.5
+void ProcGen_InitParams(ProcGenParams* params, int kind, int w, int h);
+
+// Linear ramp through stopsLen colors (0xRRGGBBAA) at ascending positions
+// from 0 to 1, written as a 256 entry palette
+void ProcGen_MakePalette(const unsigned int* colors, const float* positions, int stopsLen, 
+                         unsigned int* palette);
+
+// Identifies what the params generate, palette contents included
+unsigned int ProcGen_Hash(const ProcGenParams* params);
+
+// dst must have room for w*h*4 bytes
+void ProcGen_Generate(const ProcGenParams* params, unsigned char* dst);
+
+// Same, but loads the result from cacheDir if it was generated before, and
+// stores it there otherwise. A relative cacheDir is in the executable's 
+// directory. Returns true if it came from the cache.
+bool ProcGen_GenerateCached(const ProcGenParams* params, unsigned char* dst, const char* cacheDir);
@@ -0,0 +1,550 @@
+﻿#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define SCENE_SSE2
+#endif
+
+#include "system.h"
+#include "scene.h"
+
+namespace {
+
+// Below this many nodes a single thread is done before workers wake up
+const int PARALLEL_NODES_MIN = 16384;
+
+// Unsorted and removed slots update() puts up with before it sorts again,
+// plus one for every eight sorted ones
+const int REBUILD_SLACK = 256;
+
+const float IDENTITY[6] = { 1.f, 0.f, 0.f, 1.f, 0.f, 0.f };
+
+}  // anonymous namespace
+
+struct SceneGraph::WorkerPool
+{
+    struct Worker
+    {
+        SceneGraph* graph;
+        int group;
+        HANDLE thread;
+        HANDLE start;
+        HANDLE done;
+    };
+
+    static DWORD WINAPI workerProc(void* user);
+
+    static const int WORKERS_MAX = 7;
+    Worker workers[WORKERS_MAX];
+    volatile LONG quit;
+};
+
+SceneGraph::SceneGraph(int aNodesMax)
+    : nodesMax(aNodesMax)
+    , handlesLen(0)
+    , freeHead(-1)
+    , slotsLen(0)
+    , sortedLen(0)
+    , removedLen(0)
+    , groupsLen(1)
+    , workers(NULL)
+    , workersLen(0)
+{
+    slotOf = new int[nodesMax];
+    parentOf = new int[nodesMax];
+    rootOf = new int[nodesMax];
+    childrenOf = new int[nodesMax];
+    depthOf = new unsigned char[nodesMax];
+    sprites = new Sprite[nodesMax];
+
+    handleOf = new int[nodesMax];
+    parentSlot = new int[nodesMax];
+    backHandleOf = new int[nodesMax];
+    backParentSlot = new int[nodesMax];
+    for (int i=0; i<6; i++) 
+    {
+        local[i] = new float[nodesMax];
+        world[i] = new float[nodesMax+1];
+        world[i][nodesMax] = IDENTITY[i];
+        backLocal[i] = new float[nodesMax];
+        backWorld[i] = new float[nodesMax+1];
+        backWorld[i][nodesMax] = IDENTITY[i];
+    }
+    dirty = new unsigned char[nodesMax];
+    backDirty = new unsigned char[nodesMax];
+    groupOf = new int[nodesMax];
+    newSlots = new int[nodesMax];
+    changed = new unsigned char[nodesMax+1];
+    changed[nodesMax] = 0;
+
+    if (nodesMax >= PARALLEL_NODES_MIN) 
+    {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        workersLen = (int)info.dwNumberOfProcessors - 1;
+        if (workersLen > WorkerPool::WORKERS_MAX) {
+            workersLen = WorkerPool::WORKERS_MAX;
+        }
+    }
+    bucketStarts = new int[(workersLen+1)*DEPTH_MAX + 1];
+    memset(bucketStarts, 0, ((workersLen+1)*DEPTH_MAX + 1)*sizeof(int));
+    bucketFill = new int[(workersLen+1)*DEPTH_MAX];
+
+    // Group 0 is the calling thread's
+    if (workersLen > 0) 
+    {
+        workers = new WorkerPool;
+        workers->quit = 0;
+    }
+    for (int i=0; i<workersLen; i++) 
+    {
+        WorkerPool::Worker& worker = workers->workers[i];
+        worker.graph = this;
+        worker.group = i+1;
+        worker.start = CreateEvent(NULL, FALSE, FALSE, NULL);
+        worker.done = CreateEvent(NULL, FALSE, FALSE, NULL);
+        worker.thread = CreateThread(NULL, 0, WorkerPool::workerProc, &worker, 0, NULL);
+    }
+}
+
+SceneGraph::~SceneGraph()
+{
+    if (workers != NULL) {
+        InterlockedExchange(&workers->quit, 1);
+    }
+    for (int i=0; i<workersLen; i++) 
+    {
+        WorkerPool::Worker& worker = workers->workers[i];
+        SetEvent(worker.start);
+        WaitForSingleObject(worker.thread, INFINITE);
+        CloseHandle(worker.thread);
+        CloseHandle(worker.start);
+        CloseHandle(worker.done);
+    }
+    delete workers;
+
+    delete[] slotOf;
+    delete[] parentOf;
+    delete[] rootOf;
+    delete[] childrenOf;
+    delete[] depthOf;
+    delete[] sprites;
+    delete[] handleOf;
+    delete[] parentSlot;
+    delete[] backHandleOf;
+    delete[] backParentSlot;
+    for (int i=0; i<6; i++) 
+    {
+        delete[] local[i];
+        delete[] world[i];
+        delete[] backLocal[i];
+        delete[] backWorld[i];
+    }
+    delete[] dirty;
+    delete[] backDirty;
+    delete[] groupOf;
+    delete[] newSlots;
+    delete[] changed;
+    delete[] bucketStarts;
+    delete[] bucketFill;
+}
+
+int SceneGraph::add(int parent)
+{
+    int depth = 0;
+    if (parent != -1) 
+    {
+        if (parent < 0 || parent >= handlesLen || slotOf[parent] < 0) {
+            return -1;
+        }
+        depth = depthOf[parent] + 1;
+        if (depth >= DEPTH_MAX) {
+            return -1;
+        }
+    }
+
+    // Removed slots are only reclaimed by rebuild()
+    if (slotsLen == nodesMax) {
+        rebuild();
+    }
+    if (slotsLen == nodesMax) {
+        return -1;
+    }
+
+    int handle = -1;
+    if (freeHead >= 0) 
+    {
+        handle = freeHead;
+        freeHead = parentOf[handle];
+    } 
+    else 
+    {
+        handle = handlesLen++;
+    }
+
+    int slot = slotsLen++;
+    slotOf[handle] = slot;
+    parentOf[handle] = parent;
+    rootOf[handle] = parent != -1 ? rootOf[parent] : handle;
+    childrenOf[handle] = 0;
+    depthOf[handle] = (unsigned char)depth;
+    if (parent != -1) {
+        childrenOf[parent]++;
+    }
+    sprites[handle].hTexture = -1;
+
+    handleOf[slot] = handle;
+    parentSlot[slot] = parent != -1 ? slotOf[parent] : nodesMax;
+    for (int i=0; i<6; i++) {
+        local[i][slot] = IDENTITY[i];
+    }
+    dirty[slot] = 1;
+    return handle;
+}
+
+void SceneGraph::remove(int handle)
+{
+    if (handle < 0 || handle >= handlesLen || slotOf[handle] < 0) {
+        return;
+    }
+
+    if (parentOf[handle] != -1) {
+        childrenOf[parentOf[handle]]--;
+    }
+
+    // Parents come before children in slot order, so one pass finds the 
+    // whole subtree, and a leaf is just its own slot. Removed slots keep 
+    // -1 as their handle until rebuild().
+    int first = slotOf[handle];
+    int end = childrenOf[handle] > 0 ? slotsLen : first+1;
+    for (int slot=first; slot<end; slot++)
+    {
+        int h = handleOf[slot];
+        if (h < 0) {
+            continue;
+        }
+        if (slot == first || (parentSlot[slot] < nodesMax && handleOf[parentSlot[slot]] < 0)) 
+        {
+            handleOf[slot] = -1;
+            slotOf[h] = -1;
+            parentOf[h] = freeHead;
+            freeHead = h;
+            removedLen++;
+        }
+    }
+}
+
+void SceneGraph::setLocal(int handle, float x, float y, float rotation, float scaleX, float scaleY)
+{
+    float cosA = cosf(rotation);
+    float sinA = sinf(rotation);
+    float m[6] = { cosA*scaleX, sinA*scaleX, -sinA*scaleY, cosA*scaleY, x, y };
+    setLocalMatrix(handle, m);
+}
+
+void SceneGraph::setLocalMatrix(int handle, const float* m)
+{
+    if (handle < 0 || handle >= handlesLen || slotOf[handle] < 0) {
+        return;
+    }
+
+    int slot = slotOf[handle];
+    for (int i=0; i<6; i++) {
+        local[i][slot] = m[i];
+    }
+    dirty[slot] = 1;
+}
+
+void SceneGraph::getWorld(int handle, float* m) const
+{
+    if (handle < 0 || handle >= handlesLen || slotOf[handle] < 0) 
+    {
+        memcpy(m, IDENTITY, sizeof(IDENTITY));
+        return;
+    }
+
+    int slot = slotOf[handle];
+    for (int i=0; i<6; i++) {
+        m[i] = world[i][slot];
+    }
+}
+
+void SceneGraph::setSprite(int handle, int hTexture, float x, float y, float w, float h,
+                           float tx, float ty, float tw, float th, unsigned int color)
+{
+    if (handle < 0 || handle >= handlesLen || slotOf[handle] < 0) {
+        return;
+    }
+
+    Sprite& sprite = sprites[handle];
+    sprite.hTexture = hTexture;
+    sprite.quad[0] = x;
+    sprite.quad[1] = y;
+    sprite.quad[2] = w;
+    sprite.quad[3] = h;
+    sprite.quad[4] = tx;
+    sprite.quad[5] = ty;
+    sprite.quad[6] = tw;
+    sprite.quad[7] = th;
+    sprite.color = color;
+}
+
+void SceneGraph::update()
+{
+    // Sorting costs about as much as a full update, so a few adds and 
+    // removes a frame shouldn't each pay for one
+    if ((slotsLen - sortedLen) + removedLen > REBUILD_SLACK + sortedLen/8) {
+        rebuild();
+    }
+
+    for (int i=1; i<groupsLen; i++) {
+        SetEvent(workers->workers[i-1].start);
+    }
+    updateGroup(0);
+    for (int i=1; i<groupsLen; i++) {
+        WaitForSingleObject(workers->workers[i-1].done, INFINITE);
+    }
+
+    // A slot added since the sort may sit right behind its parent, so
+    // these can't go four at a time
+    updateSerial(sortedLen, slotsLen);
+}
+
+void SceneGraph::render(SysAPI* sys) const
+{
+    int hTexture = -1;
+    for (int h=0; h<handlesLen; h++)
+    {
+        const Sprite& sprite = sprites[h];
+        if (slotOf[h] < 0 || sprite.hTexture < 0) {
+            continue;
+        }
+
+        // Consecutive sprites of a texture end up in one batch
+        if (sprite.hTexture != hTexture) 
+        {
+            hTexture = sprite.hTexture;
+            Sys_SetTexture(sys, hTexture);
+        }
+
+        float m[6];
+        getWorld(h, m);
+        const float* q = sprite.quad;
+        Sys_RenderAffine(sys, m, q[0], q[1], q[2], q[3], q[4], q[5], q[6], q[7], sprite.color);
+    }
+}
+
+DWORD WINAPI SceneGraph::WorkerPool::workerProc(void* user)
+{
+    Worker& worker = *(Worker*)user;
+    for (;;)
+    {
+        WaitForSingleObject(worker.start, INFINITE);
+        if (InterlockedCompareExchange(&worker.graph->workers->quit, 0, 0) != 0) {
+            break;
+        }
+        worker.graph->updateGroup(worker.group);
+        SetEvent(worker.done);
+    }
+    return 0;
+}
+
+// Sorts slots by group and depth, dropping removed ones. Root subtrees
+// are dealt to groups in handle order, about the same number of nodes 
+// each, so every group only ever looks at its own slots.
+void SceneGraph::rebuild()
+{
+    int liveLen = 0;
+    for (int slot=0; slot<slotsLen; slot++) 
+    {
+        if (handleOf[slot] >= 0) {
+            liveLen++;
+        }
+    }
+
+    groupsLen = liveLen >= PARALLEL_NODES_MIN ? workersLen+1 : 1;
+
+    // Subtree sizes go to groupOf of the roots first
+    for (int slot=0; slot<slotsLen; slot++) 
+    {
+        int h = handleOf[slot];
+        if (h >= 0 && rootOf[h] == h) {
+            groupOf[h] = 0;
+        }
+    }
+    for (int slot=0; slot<slotsLen; slot++) 
+    {
+        int h = handleOf[slot];
+        if (h >= 0) {
+            groupOf[rootOf[h]]++;
+        }
+    }
+    int group = 0;
+    int groupSize = 0;
+    int groupTarget = (liveLen + groupsLen-1) / groupsLen;
+    for (int h=0; h<handlesLen; h++)
+    {
+        if (slotOf[h] < 0 || handleOf[slotOf[h]] != h || rootOf[h] != h) {
+            continue;
+        }
+        int size = groupOf[h];
+        groupOf[h] = group;
+        groupSize += size;
+        if (groupSize >= groupTarget && group < groupsLen-1) 
+        {
+            group++;
+            groupSize = 0;
+        }
+    }
+
+    // Counting sort by group and depth
+    int bucketsLen = groupsLen*DEPTH_MAX;
+    memset(bucketStarts, 0, (bucketsLen+1)*sizeof(int));
+    for (int slot=0; slot<slotsLen; slot++) 
+    {
+        int h = handleOf[slot];
+        if (h >= 0) {
+            bucketStarts[groupOf[rootOf[h]]*DEPTH_MAX + depthOf[h] + 1]++;
+        }
+    }
+    for (int i=0; i<bucketsLen; i++) {
+        bucketStarts[i+1] += bucketStarts[i];
+    }
+
+    memcpy(bucketFill, bucketStarts, bucketsLen*sizeof(int));
+    for (int slot=0; slot<slotsLen; slot++) 
+    {
+        int h = handleOf[slot];
+        newSlots[slot] = h >= 0 ? bucketFill[groupOf[rootOf[h]]*DEPTH_MAX + depthOf[h]]++ : -1;
+    }
+
+    // Move everything over to the back arrays and swap. World transforms 
+    // move along, so only nodes marked dirty get recomputed.
+    for (int slot=0; slot<slotsLen; slot++)
+    {
+        int dst = newSlots[slot];
+        if (dst < 0) {
+            continue;
+        }
+        int h = handleOf[slot];
+        backHandleOf[dst] = h;
+        backParentSlot[dst] = parentSlot[slot] < nodesMax ? newSlots[parentSlot[slot]] : nodesMax;
+        backDirty[dst] = dirty[slot];
+        for (int i=0; i<6; i++) 
+        {
+            backLocal[i][dst] = local[i][slot];
+            backWorld[i][dst] = world[i][slot];
+        }
+        slotOf[h] = dst;
+    }
+
+    int* swapInts = handleOf;
+    handleOf = backHandleOf;
+    backHandleOf = swapInts;
+    swapInts = parentSlot;
+    parentSlot = backParentSlot;
+    backParentSlot = swapInts;
+    unsigned char* swapBytes = dirty;
+    dirty = backDirty;
+    backDirty = swapBytes;
+    for (int i=0; i<6; i++) 
+    {
+        float* swapFloats = local[i];
+        local[i] = backLocal[i];
+        backLocal[i] = swapFloats;
+        swapFloats = world[i];
+        world[i] = backWorld[i];
+        backWorld[i] = swapFloats;
+    }
+
+    slotsLen = liveLen;
+    sortedLen = liveLen;
+    removedLen = 0;
+}
+
+void SceneGraph::updateGroup(int group)
+{
+    // Each depth only depends on the one above it
+    const int* starts = bucketStarts + group*DEPTH_MAX;
+    for (int d=0; d<DEPTH_MAX; d++) {
+        updateRange(starts[d], starts[d+1]);
+    }
+}
+
+// World = parent world * local, for slots whose own transform or parent's
+// world changed
+void SceneGraph::updateRange(int begin, int end)
+{
+    const float* const* l = local;
+    float* const* w = world;
+
+    int s = begin;
+#ifdef SCENE_SSE2
+    for (; s+4 <= end; s+=4)
+    {
+        const int* ps = parentSlot + s;
+        int any = 0;
+        for (int k=0; k<4; k++) 
+        {
+            changed[s+k] = dirty[s+k] | changed[ps[k]];
+            dirty[s+k] = 0;
+            any |= changed[s+k];
+        }
+        // Lanes that didn't change come out the same, no need to mask them
+        if (!any) {
+            continue;
+        }
+
+        __m128 pa = _mm_set_ps(w[0][ps[3]], w[0][ps[2]], w[0][ps[1]], w[0][ps[0]]);
+        __m128 pb = _mm_set_ps(w[1][ps[3]], w[1][ps[2]], w[1][ps[1]], w[1][ps[0]]);
+        __m128 pc = _mm_set_ps(w[2][ps[3]], w[2][ps[2]], w[2][ps[1]], w[2][ps[0]]);
+        __m128 pd = _mm_set_ps(w[3][ps[3]], w[3][ps[2]], w[3][ps[1]], w[3][ps[0]]);
+        __m128 ptx = _mm_set_ps(w[4][ps[3]], w[4][ps[2]], w[4][ps[1]], w[4][ps[0]]);
+        __m128 pty = _mm_set_ps(w[5][ps[3]], w[5][ps[2]], w[5][ps[1]], w[5][ps[0]]);
+
+        __m128 la = _mm_loadu_ps(l[0] + s);
+        __m128 lb = _mm_loadu_ps(l[1] + s);
+        __m128 lc = _mm_loadu_ps(l[2] + s);
+        __m128 ld = _mm_loadu_ps(l[3] + s);
+        __m128 ltx = _mm_loadu_ps(l[4] + s);
+        __m128 lty = _mm_loadu_ps(l[5] + s);
+
+        _mm_storeu_ps(w[0] + s, _mm_add_ps(_mm_mul_ps(pa, la), _mm_mul_ps(pc, lb)));
+        _mm_storeu_ps(w[1] + s, _mm_add_ps(_mm_mul_ps(pb, la), _mm_mul_ps(pd, lb)));
+        _mm_storeu_ps(w[2] + s, _mm_add_ps(_mm_mul_ps(pa, lc), _mm_mul_ps(pc, ld)));
+        _mm_storeu_ps(w[3] + s, _mm_add_ps(_mm_mul_ps(pb, lc), _mm_mul_ps(pd, ld)));
+        _mm_storeu_ps(w[4] + s, _mm_add_ps(_mm_add_ps(_mm_mul_ps(pa, ltx), _mm_mul_ps(pc, lty)), ptx));
+        _mm_storeu_ps(w[5] + s, _mm_add_ps(_mm_add_ps(_mm_mul_ps(pb, ltx), _mm_mul_ps(pd, lty)), pty));
+    }
+#endif
+    updateSerial(s, end);
+}
+
+void SceneGraph::updateSerial(int begin, int end)
+{
+    const float* const* l = local;
+    float* const* w = world;
+
+    for (int s=begin; s<end; s++)
+    {
+        int p = parentSlot[s];
+        changed[s] = dirty[s] | changed[p];
+        dirty[s] = 0;
+        if (!changed[s]) {
+            continue;
+        }
+
+        float a = w[0][p], b = w[1][p], c = w[2][p], d = w[3][p];
+        w[0][s] = a*l[0][s] + c*l[1][s];
+        w[1][s] = b*l[0][s] + d*l[1][s];
+        w[2][s] = a*l[2][s] + c*l[3][s];
+        w[3][s] = b*l[2][s] + d*l[3][s];
+        w[4][s] = a*l[4][s] + c*l[5][s] + w[4][p];
+        w[5][s] = b*l[4][s] + d*l[5][s] + w[5][p];
+    }
+}
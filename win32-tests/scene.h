@@ -0,0 +1,103 @@
+﻿#pragma once
+
+struct SysAPI;
+
+// Parent/child 2D transforms. Transforms are affine, stored as a, b, c, d,
+// tx, ty: x' = a*x + c*y + tx, y' = b*x + d*y + ty.
+//
+// Nodes live in flat arrays sorted by root subtree group and depth, so 
+// update() can go level by level, four nodes at a time where SSE2 is 
+// available, recomputing only what changed or sits below something that
+// did. Big scenes split their root subtrees between worker threads.
+class SceneGraph
+{
+public:
+    explicit SceneGraph(int nodesMax);
+    ~SceneGraph();
+
+    // Returns a handle, or -1 if full, parent isn't valid or the tree 
+    // would get deeper than DEPTH_MAX. parent -1 adds a root.
+    int  add(int parent);
+    // Removes the node with everything below it
+    void remove(int handle);
+
+    // Translation, rotation in radians and scale, applied scale first
+    void setLocal(int handle, float x, float y, float rotation, float scaleX, float scaleY);
+    void setLocalMatrix(int handle, const float* m);
+    // As of the last update()
+    void getWorld(int handle, float* m) const;
+
+    // A quad (x, y, w, h) in the node's space drawn by render(), with 
+    // the texture rect and color Sys_RenderEx takes. hTexture -1 clears it.
+    void setSprite(int handle, int hTexture, float x, float y, float w, float h,
+                   float tx, float ty, float tw, float th, unsigned int color);
+
+    void update();
+    // Sprites in handle order, with world transforms of the last update()
+    void render(SysAPI* sys) const;
+
+    static const int DEPTH_MAX = 64;
+
+private:
+    SceneGraph(const SceneGraph&);
+    SceneGraph& operator=(const SceneGraph&);
+
+    struct Sprite
+    {
+        int hTexture;
+        float quad[8];
+        unsigned int color;
+    };
+
+    // Threads for groups 1 and up, in scene.cpp with the platform code
+    struct WorkerPool;
+
+    void rebuild();
+    void updateGroup(int group);
+    void updateRange(int begin, int end);
+    void updateSerial(int begin, int end);
+
+    int nodesMax;
+
+    // Per handle, slot -1 for free handles
+    int* slotOf;
+    int* parentOf;
+    int* rootOf;
+    int* childrenOf;
+    unsigned char* depthOf;
+    Sprite* sprites;
+    int handlesLen;
+    // Removed handles, chained through parentOf
+    int freeHead;
+
+    // Per slot. Slots added since the last rebuild are appended unsorted,
+    // which still keeps parents ahead of their children. The slot at 
+    // nodesMax holds the identity, every root's parent.
+    int* handleOf;
+    int* parentSlot;
+    float* local[6];
+    float* world[6];
+    unsigned char* dirty;
+    unsigned char* changed;
+    int slotsLen;
+    // Slots below sortedLen are in bucketStarts order, removed ones included
+    int sortedLen;
+    int removedLen;
+
+    // rebuild() writes these and swaps them with the ones above
+    int* backHandleOf;
+    int* backParentSlot;
+    float* backLocal[6];
+    float* backWorld[6];
+    unsigned char* backDirty;
+    int* groupOf;
+    int* newSlots;
+    int* bucketFill;
+
+    // Slots of group g at depth d start at bucketStarts[g*DEPTH_MAX + d]
+    int* bucketStarts;
+    int groupsLen;
+
+    WorkerPool* workers;
+    int workersLen;
+};
@@ -0,0 +1,265 @@
+﻿#include <math.h>
+
+#include "spatial.h"
+
+SpatialGrid::SpatialGrid(float aWorldX, float aWorldY, float worldW, float worldH, 
+                         float aCellSize, int aObjectsMax)
+    : worldX(aWorldX)
+    , worldY(aWorldY)
+    , cellSize(aCellSize)
+    , invCellSize(1.f / aCellSize)
+    , objectsMax(aObjectsMax)
+    , largeHead(-1)
+    , freeHead(-1)
+    , objectsLen(0)
+    , count(0)
+{
+    cellsX = (int)ceil(worldW * invCellSize);
+    cellsY = (int)ceil(worldH * invCellSize);
+    if (cellsX < 1) {
+        cellsX = 1;
+    }
+    if (cellsY < 1) {
+        cellsY = 1;
+    }
+
+    cellHeads = new int[cellsX*cellsY];
+    for (int i=0; i<cellsX*cellsY; i++) {
+        cellHeads[i] = -1;
+    }
+
+    boxes = new float[objectsMax*4];
+    cells = new int[objectsMax];
+    next = new int[objectsMax];
+    prev = new int[objectsMax];
+}
+
+SpatialGrid::~SpatialGrid()
+{
+    delete[] cellHeads;
+    delete[] boxes;
+    delete[] cells;
+    delete[] next;
+    delete[] prev;
+}
+
+int SpatialGrid::add(float x, float y, float w, float h)
+{
+    int handle = -1;
+    if (freeHead >= 0) 
+    {
+        handle = freeHead;
+        freeHead = next[handle];
+    } 
+    else if (objectsLen < objectsMax) 
+    {
+        handle = objectsLen++;
+    } 
+    else 
+    {
+        return -1;
+    }
+
+    float* box = &boxes[handle*4];
+    box[0] = x;
+    box[1] = y;
+    box[2] = w;
+    box[3] = h;
+    link(handle, getCell(x, y, w, h));
+    count++;
+    return handle;
+}
+
+void SpatialGrid::move(int handle, float x, float y, float w, float h)
+{
+    if (handle < 0 || handle >= objectsLen || cells[handle] == FREE_CELL) {
+        return;
+    }
+
+    float* box = &boxes[handle*4];
+    box[0] = x;
+    box[1] = y;
+    box[2] = w;
+    box[3] = h;
+
+    int cell = getCell(x, y, w, h);
+    if (cell != cells[handle]) 
+    {
+        unlink(handle);
+        link(handle, cell);
+    }
+}
+
+void SpatialGrid::remove(int handle)
+{
+    if (handle < 0 || handle >= objectsLen || cells[handle] == FREE_CELL) {
+        return;
+    }
+
+    unlink(handle);
+    cells[handle] = FREE_CELL;
+    next[handle] = freeHead;
+    freeHead = handle;
+    count--;
+}
+
+int SpatialGrid::queryPoint(float x, float y, int* results, int resultsMax) const
+{
+    // A point is a rect with no area, but it's inside [x, x+w) boxes
+    return queryRect(x, y, 0.f, 0.f, results, resultsMax);
+}
+
+int SpatialGrid::queryRect(float x, float y, float w, float h, int* results, int resultsMax) const
+{
+    float x1 = x + w;
+    float y1 = y + h;
+    int found = scanList(largeHead, x, y, x1, y1, results, resultsMax, 0);
+
+    // Boxes filed under a cell reach at most half a cell out of it
+    float margin = cellSize*0.5f;
+    int cx0 = getCellCoord(x - margin, worldX, cellsX);
+    int cy0 = getCellCoord(y - margin, worldY, cellsY);
+    int cx1 = getCellCoord(x1 + margin, worldX, cellsX);
+    int cy1 = getCellCoord(y1 + margin, worldY, cellsY);
+    for (int cy=cy0; cy<=cy1; cy++) {
+        for (int cx=cx0; cx<=cx1; cx++) {
+            found = scanList(cellHeads[cy*cellsX + cx], x, y, x1, y1, results, resultsMax, found);
+        }
+    }
+    return found;
+}
+
+int SpatialGrid::queryNearest(float x, float y, float maxDistance) const
+{
+    int best = -1;
+    float bestDist2 = maxDistance*maxDistance;
+    scanNearest(largeHead, x, y, best, bestDist2);
+
+    // Rings of cells around the point's, until a ring's boxes can't be 
+    // closer than the best so far. Box edges reach half a cell out of 
+    // their cell, so ring r is at least (r - 1.5) cells away.
+    int cx = getCellCoord(x, worldX, cellsX);
+    int cy = getCellCoord(y, worldY, cellsY);
+    int ringsLen = cellsX > cellsY ? cellsX : cellsY;
+    for (int r=0; r<ringsLen; r++)
+    {
+        float ringDist = (r - 1.5f) * cellSize;
+        if (ringDist > 0.f && ringDist*ringDist > bestDist2) {
+            break;
+        }
+
+        for (int ry=cy-r; ry<=cy+r; ry++)
+        {
+            if (ry < 0 || ry >= cellsY) {
+                continue;
+            }
+
+            // Top and bottom rows of the ring are full, the rest only 
+            // has its two ends
+            bool fullRow = ry == cy-r || ry == cy+r;
+            int step = fullRow || r == 0 ? 1 : 2*r;
+            for (int rx=cx-r; rx<=cx+r; rx+=step) 
+            {
+                if (rx >= 0 && rx < cellsX) {
+                    scanNearest(cellHeads[ry*cellsX + rx], x, y, best, bestDist2);
+                }
+            }
+        }
+    }
+    return best;
+}
+
+int SpatialGrid::getCellCoord(float value, float origin, int cellsLen) const
+{
+    float c = floor((value - origin) * invCellSize);
+    if (c < 0.f) {
+        return 0;
+    }
+    if (c >= (float)cellsLen) {
+        return cellsLen-1;
+    }
+    return (int)c;
+}
+
+int SpatialGrid::getCell(float x, float y, float w, float h) const
+{
+    if (w > cellSize || h > cellSize) {
+        return LARGE_CELL;
+    }
+    int cx = getCellCoord(x + w*0.5f, worldX, cellsX);
+    int cy = getCellCoord(y + h*0.5f, worldY, cellsY);
+    return cy*cellsX + cx;
+}
+
+int& SpatialGrid::getListHead(int cell)
+{
+    return cell == LARGE_CELL ? largeHead : cellHeads[cell];
+}
+
+void SpatialGrid::link(int handle, int cell)
+{
+    int& head = getListHead(cell);
+    next[handle] = head;
+    prev[handle] = -1;
+    if (head >= 0) {
+        prev[head] = handle;
+    }
+    head = handle;
+    cells[handle] = cell;
+}
+
+void SpatialGrid::unlink(int handle)
+{
+    if (prev[handle] >= 0) {
+        next[prev[handle]] = next[handle];
+    } else {
+        getListHead(cells[handle]) = next[handle];
+    }
+    if (next[handle] >= 0) {
+        prev[next[handle]] = prev[handle];
+    }
+}
+
+// Boxes are half open like pixels: [x, x+w) contains x but not x+w. The 
+// query rect is closed, so that zero sized ones work as points.
+int SpatialGrid::scanList(int head, float x0, float y0, float x1, float y1, 
+                          int* results, int resultsMax, int found) const
+{
+    for (int i=head; i>=0; i=next[i])
+    {
+        const float* box = &boxes[i*4];
+        if (box[0] <= x1 && x0 < box[0] + box[2] && box[1] <= y1 && y0 < box[1] + box[3]) 
+        {
+            if (found < resultsMax) {
+                results[found] = i;
+            }
+            found++;
+        }
+    }
+    return found;
+}
+
+void SpatialGrid::scanNearest(int head, float x, float y, int& best, float& bestDist2) const
+{
+    for (int i=head; i>=0; i=next[i])
+    {
+        const float* box = &boxes[i*4];
+        float dx = box[0] - x;
+        if (dx < x - (box[0] + box[2])) {
+            dx = x - (box[0] + box[2]);
+        }
+        float dy = box[1] - y;
+        if (dy < y - (box[1] + box[3])) {
+            dy = y - (box[1] + box[3]);
+        }
+        dx = dx > 0.f ? dx : 0.f;
+        dy = dy > 0.f ? dy : 0.f;
+
+        float dist2 = dx*dx + dy*dy;
+        if (dist2 <= bestDist2) 
+        {
+            best = i;
+            bestDist2 = dist2;
+        }
+    }
+}
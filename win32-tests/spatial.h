@@ -0,0 +1,72 @@
+﻿#pragma once
+
+// Axis aligned boxes in a uniform grid for hit testing and overlap 
+// queries. Boxes up to a cell in size are filed under the cell of their 
+// center, so a query only has to look at the cells it overlaps, grown by 
+// half a cell. Bigger boxes go in a list every query checks.
+class SpatialGrid
+{
+public:
+    // The grid covers worldW x worldH from (worldX, worldY), boxes outside 
+    // are filed under the nearest border cell. Cells about the size of a 
+    // typical box work best.
+    SpatialGrid(float worldX, float worldY, float worldW, float worldH, 
+                float cellSize, int objectsMax);
+    ~SpatialGrid();
+
+    // Returns a handle, or -1 if objectsMax boxes are in already
+    int  add(float x, float y, float w, float h);
+    // Cheap while the center stays in its cell, otherwise relinks the box
+    void move(int handle, float x, float y, float w, float h);
+    void remove(int handle);
+
+    int getCount() const { return count; }
+
+    // Write up to resultsMax handles of boxes containing the point or 
+    // overlapping the rect, in no particular order. Return how many there
+    // are in total, which may be more than resultsMax.
+    int queryPoint(float x, float y, int* results, int resultsMax) const;
+    int queryRect(float x, float y, float w, float h, int* results, int resultsMax) const;
+
+    // Handle of the box closest to the point, at most maxDistance away, 
+    // or -1. Boxes containing the point are at distance 0.
+    int queryNearest(float x, float y, float maxDistance) const;
+
+private:
+    SpatialGrid(const SpatialGrid&);
+    SpatialGrid& operator=(const SpatialGrid&);
+
+    static const int LARGE_CELL = -2;
+    static const int FREE_CELL = -1;
+
+    int getCellCoord(float value, float origin, int cellsLen) const;
+    int getCell(float x, float y, float w, float h) const;
+    int& getListHead(int cell);
+    void link(int handle, int cell);
+    void unlink(int handle);
+
+    int scanList(int head, float x0, float y0, float x1, float y1, 
+                 int* results, int resultsMax, int found) const;
+    void scanNearest(int head, float x, float y, int& best, float& bestDist2) const;
+
+    float worldX;
+    float worldY;
+    float cellSize;
+    float invCellSize;
+    int cellsX;
+    int cellsY;
+    int objectsMax;
+
+    // Per object: box as x, y, w, h, its cell and list links
+    float* boxes;
+    int* cells;
+    int* next;
+    int* prev;
+
+    int* cellHeads;
+    int largeHead;
+    // Removed slots, chained through next
+    int freeHead;
+    int objectsLen;
+    int count;
+};
@@ -15,6 +15,184 @@ void Sys_Render(SysAPI* sys,
                 float tx, float ty, 
                 float tw, float th);
 
+// GPU storage formats. Data is always passed as RGBA8 and packed on load:
+// R8 keeps red as opaque grey, RG8 keeps red and alpha as grey with alpha
+// (masks, glyphs). BC formats are compressed by the driver, and fall back 
+// to RGB565 and RGBA4444 where it doesn't support them.
+enum TextureFormat
+{
+    TEXTURE_RGBA8    = 0,
+    TEXTURE_R8       = 1,
+    TEXTURE_RG8      = 2,
+    TEXTURE_RGB565   = 3,
+    TEXTURE_RGBA4444 = 4,
+    TEXTURE_BC1      = 5,
+    TEXTURE_BC3      = 6,
+};
+
+int  Sys_LoadTextureEx(SysAPI* sys, const unsigned char* data, int w, int h, int format);
+
+// Textures are evicted from the GPU, least recently set first, when the
+// loaded ones would take more than the budget (256 MB by default, 0 for 
+// no limit), and reloaded from a system memory copy when used again. 
+// Released handles may be reused by later loads.
+void Sys_ReleaseTexture(SysAPI* sys, int hTexture);
+void Sys_SetTextureBudget(SysAPI* sys, int bytes);
+
+// Same as Sys_Render, but rotated by rotation radians and scaled around 
+// the pivot, which is relative to the quad's top-left corner. color is 
+// packed as 0xRRGGBBAA. Stays in the same batch as plain quads.
+void Sys_RenderEx(SysAPI* sys, 
+                  float sx, float sy, 
+                  float sw, float sh, 
+                  float tx, float ty, 
+                  float tw, float th,
+                  float pivotX, float pivotY,
+                  float rotation, float scaleX, float scaleY,
+                  unsigned int color);
+
+// Draws the quad through a 2D affine transform { a, b, c, d, tx, ty }, 
+// mapping (x, y) to (a*x + c*y + tx, b*x + d*y + ty). Meant for transforms
+// that are already combined, like SceneGraph's world ones.
+void Sys_RenderAffine(SysAPI* sys, 
+                      const float* transform,
+                      float sx, float sy, 
+                      float sw, float sh, 
+                      float tx, float ty, 
+                      float tw, float th,
+                      unsigned int color);
+
+// Layered rendering: depth goes from 0 (front) to 1. Opaque quads are 
+// drawn front to back with depth test and write, so overlapped pixels are
+// shaded once, then blended ones back to front. Layered quads are queued 
+// and drawn over everything else at Sys_FlushLayers or the end of the frame.
+// Vertex layouts without depth draw them all back to front instead.
+void Sys_RenderDepth(SysAPI* sys, 
+                     float sx, float sy, 
+                     float sw, float sh, 
+                     float tx, float ty, 
+                     float tw, float th,
+                     float depth, int opaque);
+void Sys_FlushLayers(SysAPI* sys);
+
+// Render layers cache content that rarely changes, like HUD panels. A 
+// layer is a w x h texture: everything drawn between Sys_BeginLayer and 
+// Sys_EndLayer goes into it, and it's drawn like any other texture after.
+// Sys_BeginLayer clears the layer, so call it only when the content has 
+// changed. Layers hold premultiplied alpha and are never evicted, release
+// them with Sys_ReleaseTexture. Returns -1 if render targets aren't 
+// supported.
+int  Sys_CreateLayer(SysAPI* sys, int w, int h);
+void Sys_BeginLayer(SysAPI* sys, int hLayer);
+void Sys_EndLayer(SysAPI* sys);
+
+// Uploads quads (8 floats each, same order as Sys_Render takes them) once
+// and returns a handle to redraw them with a single draw call, or -1.
+// The default vertex layout stores positions in quarter pixels within 
+// +-8191 px and clamps anything beyond, so build big geometry like a level
+// in pieces around their own origin and place them with dx, dy. Released
+// handles may be reused by later batches.
+int  Sys_CreateStaticBatch(SysAPI* sys, int hTexture, const float* quads, int quadsLen);
+void Sys_ReleaseStaticBatch(SysAPI* sys, int hBatch);
+void Sys_DrawStaticBatch(SysAPI* sys, int hBatch, float dx, float dy);
+
+// The map is split into chunks whose geometry stays on the GPU until one 
+// of their tiles changes, and only chunks on screen get drawn. Tiles index 
+// an atlasColumns x atlasRows grid over the texture, -1 is an empty tile.
+// Grids over 32767 tiles and tiles over 255 px are rejected, tiles outside
+// the grid set empty. Releasing a map frees its tiles but not the texture,
+// and the handle may be reused by later maps.
+int  Sys_CreateTilemap(SysAPI* sys, int hTexture, int w, int h, int tileSize, 
+                       int atlasColumns, int atlasRows);
+void Sys_ReleaseTilemap(SysAPI* sys, int hTilemap);
+void Sys_SetTile(SysAPI* sys, int hTilemap, int x, int y, int tile);
+void Sys_DrawTilemap(SysAPI* sys, int hTilemap, float scrollX, float scrollY);
+
+enum FontFlags
+{
+    FONT_BITMAP = 0,
+    FONT_SDF    = 1,
+};
+
+// Glyphs are rasterized on demand into an atlas shared by all fonts of 
+// the same kind, so text drawn back to back ends up in a single batch.
+// color is packed as 0xRRGGBBAA, scale is meant for SDF fonts. Text is 
+// single byte, '\n' breaks lines.
+int   Sys_LoadFont(SysAPI* sys, const char* face, int pixelSize, int flags);
+void  Sys_RenderText(SysAPI* sys, int hFont, float x, float y, float scale, 
+                     unsigned int color, const char* text);
+float Sys_MeasureText(SysAPI* sys, int hFont, const char* text);
+
+// Counters of the last completed frame
+struct RenderStats
+{
+    int drawCalls;
+    int stateChanges;
+    int stateChangesElided;
+    // Estimated GPU memory of loaded textures at the end of the frame
+    int textureBytes;
+    int textureEvictions;
+    int textureReloads;
+};
+
+void Sys_GetRenderStats(SysAPI* sys, RenderStats* stats);
+
+// GPU timings of one frame. Each draw call is a batch, timed from the end
+// of the previous one. gpuMs spans the frame's draw calls on the GPU and 
+// cpuMs the CPU time from submitting the first of them to the frame end, 
+// gpuMs well above cpuMs means the frame is bound by the GPU's fill rate.
+enum { GPU_TIMINGS_BATCHES_MAX = 256 };
+
+struct GpuBatchTiming
+{
+    int hTexture;
+    int vertices;
+    float gpuMs;
+};
+
+struct GpuTimings
+{
+    // How many frames ago the timed frame ended
+    int latency;
+    float gpuMs;
+    float cpuMs;
+    int batchesLen;
+    // Batches past GPU_TIMINGS_BATCHES_MAX, only counted in gpuMs
+    int batchesUntimed;
+    GpuBatchTiming batches[GPU_TIMINGS_BATCHES_MAX];
+};
+
+// Timer queries are off by default. Results are read a few frames late, 
+// so enabling them doesn't stall the pipeline. Returns 0 if the driver 
+// has no timer queries.
+int Sys_EnableGpuTimers(SysAPI* sys, int enable);
+// Latest frame timed, returns 0 if there's none yet
+int Sys_GetGpuTimings(SysAPI* sys, GpuTimings* timings);
+
+enum RedrawMode
+{
+    REDRAW_CONTINUOUS = 0,
+    REDRAW_ON_DEMAND  = 1,
+};
+
+// With REDRAW_ON_DEMAND the main loop sleeps until input or a window event
+// arrives, then runs one update. A frame is drawn only if the window needs 
+// repainting or Sys_RequestRedraw was called since the last one. wakeMs 
+// caps the sleep for games with timed changes, 0 waits for input only.
+// Minimized windows always sleep, background ones update at a low rate.
+void Sys_SetRedrawMode(SysAPI* sys, int mode, int wakeMs);
+void Sys_RequestRedraw(SysAPI* sys);
+
+// Updates run at a fixed rate (the frameTime given to GameAPI_Init) while
+// frames are drawn at the display's refresh rate, so several frames may 
+// show the same update. Sys_GetInterpolation tells how far, from 0 to 1,
+// the frame being rendered is between the last update and the next one.
+// Vsync is on by default, Sys_SetSwapInterval takes 0 to turn it off, 1 
+// for on, -1 for adaptive where supported, and returns 0 if it failed.
+int   Sys_SetSwapInterval(SysAPI* sys, int interval);
+int   Sys_GetRefreshRate(SysAPI* sys);
+float Sys_GetInterpolation(SysAPI* sys);
+
 enum MouseButtonState
 {
     MOUSE_BUTTON_NONE  = 0,
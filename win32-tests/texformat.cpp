@@ -0,0 +1,183 @@
+﻿#include <string.h>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define TEXFORMAT_SSE2
+#endif
+
+#include "system.h"
+#include "texformat.h"
+
+namespace {
+
+// Vector versions see four texels per register, one per 32-bit lane, 
+// laid out as 0xAABBGGRR. Each returns the packed texel in the low bits.
+
+struct PackR8
+{
+    static unsigned char texel(const unsigned char* p)
+    {
+        return p[0];
+    }
+
+#ifdef TEXFORMAT_SSE2
+    static __m128i lanes(__m128i v)
+    {
+        return _mm_and_si128(v, _mm_set1_epi32(0xFF));
+    }
+#endif
+};
+
+// Grey and alpha, the layout of GL_LUMINANCE_ALPHA
+struct PackRG8
+{
+    static unsigned short texel(const unsigned char* p)
+    {
+        return (unsigned short)(p[0] | (p[3] << 8));
+    }
+
+#ifdef TEXFORMAT_SSE2
+    static __m128i lanes(__m128i v)
+    {
+        __m128i r = _mm_and_si128(v, _mm_set1_epi32(0xFF));
+        __m128i a = _mm_and_si128(_mm_srli_epi32(v, 16), _mm_set1_epi32(0xFF00));
+        return _mm_or_si128(r, a);
+    }
+#endif
+};
+
+struct PackRGB565
+{
+    static unsigned short texel(const unsigned char* p)
+    {
+        return (unsigned short)(((p[0] >> 3) << 11) | ((p[1] >> 2) << 5) | (p[2] >> 3));
+    }
+
+#ifdef TEXFORMAT_SSE2
+    static __m128i lanes(__m128i v)
+    {
+        __m128i r = _mm_slli_epi32(_mm_and_si128(v, _mm_set1_epi32(0xF8)), 8);
+        __m128i g = _mm_and_si128(_mm_srli_epi32(v, 5), _mm_set1_epi32(0x7E0));
+        __m128i b = _mm_and_si128(_mm_srli_epi32(v, 19), _mm_set1_epi32(0x1F));
+        return _mm_or_si128(r, _mm_or_si128(g, b));
+    }
+#endif
+};
+
+struct PackRGBA4444
+{
+    static unsigned short texel(const unsigned char* p)
+    {
+        return (unsigned short)(((p[0] >> 4) << 12) | ((p[1] >> 4) << 8) 
+                                | ((p[2] >> 4) << 4) | (p[3] >> 4));
+    }
+
+#ifdef TEXFORMAT_SSE2
+    static __m128i lanes(__m128i v)
+    {
+        __m128i r = _mm_slli_epi32(_mm_and_si128(v, _mm_set1_epi32(0xF0)), 8);
+        __m128i g = _mm_and_si128(_mm_srli_epi32(v, 4), _mm_set1_epi32(0xF00));
+        __m128i b = _mm_and_si128(_mm_srli_epi32(v, 16), _mm_set1_epi32(0xF0));
+        __m128i a = _mm_srli_epi32(v, 28);
+        return _mm_or_si128(_mm_or_si128(r, g), _mm_or_si128(b, a));
+    }
+#endif
+};
+
+#ifdef TEXFORMAT_SSE2
+// Narrows eight 32-bit lanes to 16 bits. The pack instruction saturates 
+// as signed, sign extending the low halves first keeps their bits as is.
+inline __m128i packLanes16(__m128i lo, __m128i hi)
+{
+    lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+    hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+    return _mm_packs_epi32(lo, hi);
+}
+
+inline __m128i loadTexels(const unsigned char* rgba)
+{
+    return _mm_loadu_si128((const __m128i*)rgba);
+}
+#endif
+
+void convert8(const unsigned char* rgba, int texelsLen, unsigned char* dst)
+{
+    int i = 0;
+#ifdef TEXFORMAT_SSE2
+    for (; i+16 <= texelsLen; i+=16) 
+    {
+        const unsigned char* src = rgba + i*4;
+        __m128i lo = _mm_packs_epi32(PackR8::lanes(loadTexels(src)), 
+                                     PackR8::lanes(loadTexels(src+16)));
+        __m128i hi = _mm_packs_epi32(PackR8::lanes(loadTexels(src+32)), 
+                                     PackR8::lanes(loadTexels(src+48)));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; i<texelsLen; i++) {
+        dst[i] = PackR8::texel(rgba + i*4);
+    }
+}
+
+template <class Pack>
+void convert16(const unsigned char* rgba, int texelsLen, unsigned short* dst)
+{
+    int i = 0;
+#ifdef TEXFORMAT_SSE2
+    for (; i+8 <= texelsLen; i+=8) 
+    {
+        const unsigned char* src = rgba + i*4;
+        __m128i packed = packLanes16(Pack::lanes(loadTexels(src)), 
+                                     Pack::lanes(loadTexels(src+16)));
+        _mm_storeu_si128((__m128i*)(dst + i), packed);
+    }
+#endif
+    for (; i<texelsLen; i++) {
+        dst[i] = Pack::texel(rgba + i*4);
+    }
+}
+
+}  // anonymous namespace
+
+int TexFormat_GetTexelSize(int format)
+{
+    switch (format)
+    {
+        case TEXTURE_R8:
+            return 1;
+
+        case TEXTURE_RG8:
+        case TEXTURE_RGB565:
+        case TEXTURE_RGBA4444:
+            return 2;
+
+        default:
+            return 4;
+    }
+}
+
+void TexFormat_Convert(int format, const unsigned char* rgba, int texelsLen, void* dst)
+{
+    switch (format)
+    {
+        case TEXTURE_R8:
+            convert8(rgba, texelsLen, (unsigned char*)dst);
+            break;
+
+        case TEXTURE_RG8:
+            convert16<PackRG8>(rgba, texelsLen, (unsigned short*)dst);
+            break;
+
+        case TEXTURE_RGB565:
+            convert16<PackRGB565>(rgba, texelsLen, (unsigned short*)dst);
+            break;
+
+        case TEXTURE_RGBA4444:
+            convert16<PackRGBA4444>(rgba, texelsLen, (unsigned short*)dst);
+            break;
+
+        default:
+            memcpy(dst, rgba, (size_t)texelsLen*4);
+            break;
+    }
+}
@@ -0,0 +1,10 @@
+﻿#pragma once
+
+// Packs RGBA8 texels into the smaller layouts of TextureFormat before 
+// upload, four or eight texels at a time where SSE2 is available.
+
+// Bytes per texel once converted, 4 for formats uploaded as RGBA8
+int  TexFormat_GetTexelSize(int format);
+
+// dst must have room for texelsLen * TexFormat_GetTexelSize(format) bytes
+void TexFormat_Convert(int format, const unsigned char* rgba, int texelsLen, void* dst);
@@ -0,0 +1,116 @@
+﻿#include <math.h>
+
+#include "tilemap.h"
+
+Tilemap::Tilemap(int aWidth, int aHeight, int aTileSize, int aAtlasColumns, int aAtlasRows)
+    : width(aWidth)
+    , height(aHeight)
+    , tileSize(aTileSize)
+    , atlasColumns(aAtlasColumns)
+    , atlasRows(aAtlasRows)
+{
+    chunksX = (width + CHUNK_SIZE-1) / CHUNK_SIZE;
+    chunksY = (height + CHUNK_SIZE-1) / CHUNK_SIZE;
+
+    tiles = new short[width*height];
+    for (int i=0; i<width*height; i++) {
+        tiles[i] = EMPTY_TILE;
+    }
+
+    chunkRevisions = new int[chunksX*chunksY];
+    for (int i=0; i<chunksX*chunksY; i++) {
+        chunkRevisions[i] = 0;
+    }
+}
+
+Tilemap::~Tilemap()
+{
+    delete[] tiles;
+    delete[] chunkRevisions;
+}
+
+int Tilemap::getTile(int x, int y) const
+{
+    if (x < 0 || y < 0 || x >= width || y >= height) {
+        return EMPTY_TILE;
+    }
+    return tiles[y*width + x];
+}
+
+void Tilemap::setTile(int x, int y, int tile)
+{
+    if (x < 0 || y < 0 || x >= width || y >= height) {
+        return;
+    }
+    if (tile < 0 || tile >= atlasColumns*atlasRows) {
+        tile = EMPTY_TILE;
+    }
+
+    short& dst = tiles[y*width + x];
+    if (dst != tile) 
+    {
+        dst = (short)tile;
+        chunkRevisions[(y/CHUNK_SIZE)*chunksX + x/CHUNK_SIZE]++;
+    }
+}
+
+int Tilemap::getChunkRevision(int cx, int cy) const
+{
+    return chunkRevisions[cy*chunksX + cx];
+}
+
+bool Tilemap::getChunkRange(float x0, float y0, float x1, float y1, 
+                            int& cx0, int& cy0, int& cx1, int& cy1) const
+{
+    float chunkPixels = (float)(CHUNK_SIZE * tileSize);
+    cx0 = (int)floor(x0 / chunkPixels);
+    cy0 = (int)floor(y0 / chunkPixels);
+    cx1 = (int)floor(x1 / chunkPixels);
+    cy1 = (int)floor(y1 / chunkPixels);
+
+    if (cx0 < 0) {
+        cx0 = 0;
+    }
+    if (cy0 < 0) {
+        cy0 = 0;
+    }
+    if (cx1 > chunksX-1) {
+        cx1 = chunksX-1;
+    }
+    if (cy1 > chunksY-1) {
+        cy1 = chunksY-1;
+    }
+
+    return cx0 <= cx1 && cy0 <= cy1;
+}
+
+int Tilemap::buildChunk(int cx, int cy, float* quads) const
+{
+    float tw = 1.f / atlasColumns;
+    float th = 1.f / atlasRows;
+    float size = (float)tileSize;
+    int quadsLen = 0;
+
+    for (int y=0; y<CHUNK_SIZE; y++) {
+        for (int x=0; x<CHUNK_SIZE; x++) 
+        {
+            int tile = getTile(cx*CHUNK_SIZE + x, cy*CHUNK_SIZE + y);
+            if (tile == EMPTY_TILE) {
+                continue;
+            }
+
+            float* q = &quads[quadsLen*8];
+            q[0] = x * size;
+            q[1] = y * size;
+            q[2] = size;
+            q[3] = size;
+            q[4] = (tile % atlasColumns) * tw;
+            q[5] = (tile / atlasColumns) * th;
+            q[6] = tw;
+            q[7] = th;
+            quadsLen++;
+        }
+    }
+
+    return quadsLen;
+}
@@ -0,0 +1,56 @@
+﻿#pragma once
+
+// Tile data split into fixed size chunks. Each chunk has a revision that
+// changes with any of its tiles, so renderers can cache chunk geometry
+// and rebuild only what was touched.
+class Tilemap
+{
+public:
+    static const int CHUNK_SIZE = 32;
+    static const int EMPTY_TILE = -1;
+    // Tiles are stored as shorts, atlases can't have more than this
+    static const int TILES_MAX = 32767;
+    // Keeps a chunk within 8192 px, the range short vertex positions cover
+    static const int TILE_SIZE_MAX = 255;
+
+    // Tiles are numbered row by row over an atlasColumns x atlasRows grid
+    // of at most TILES_MAX tiles
+    Tilemap(int aWidth, int aHeight, int aTileSize, int aAtlasColumns, int aAtlasRows);
+    ~Tilemap();
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    int getTileSize() const { return tileSize; }
+    int getChunksX() const { return chunksX; }
+    int getChunksY() const { return chunksY; }
+
+    int  getTile(int x, int y) const;
+    void setTile(int x, int y, int tile);
+
+    int getChunkRevision(int cx, int cy) const;
+
+    // Chunks overlapping the given rect in map pixels, inclusive range. 
+    // Returns false if none do.
+    bool getChunkRange(float x0, float y0, float x1, float y1, 
+                       int& cx0, int& cy0, int& cx1, int& cy1) const;
+
+    // Writes 8 floats per non-empty tile, in Sys_Render order, positioned 
+    // relative to the chunk's top-left corner. quads must have room for 
+    // CHUNK_SIZE*CHUNK_SIZE*8 floats. Returns the number of quads.
+    int buildChunk(int cx, int cy, float* quads) const;
+
+private:
+    Tilemap(const Tilemap&);
+    Tilemap& operator=(const Tilemap&);
+
+    int width;
+    int height;
+    int tileSize;
+    int atlasColumns;
+    int atlasRows;
+    int chunksX;
+    int chunksY;
+
+    short* tiles;
+    int* chunkRevisions;
+};
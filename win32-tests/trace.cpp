@@ -0,0 +1,922 @@
+﻿#define _CRT_SECURE_NO_WARNINGS
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cmdqueue.h"
+#include "system.h"
+#include "trace.h"
+
+// Trace layout: 8 byte magic, int32 version, then a stream of records.
+// Each record is a one byte opcode followed by its arguments, written
+// raw in native (little-endian) byte order.
+
+namespace {
+
+const char TRACE_MAGIC[8] = { 'S', 'Y', 'S', 'T', 'R', 'A', 'C', 'E' };
+const int TRACE_VERSION = 1;
+
+enum TraceOp
+{
+    OP_LOAD_TEXTURE = 1,
+    OP_SET_TEXTURE,
+    OP_CLEAR_SCREEN,
+    OP_RENDER,
+    OP_CREATE_STATIC_BATCH,
+    OP_DRAW_STATIC_BATCH,
+    OP_MOUSE_BUTTON_STATE,
+    OP_MOUSE_POS,
+    OP_RESIZE,
+    OP_END_FRAME,
+    OP_LOAD_FONT,
+    OP_RENDER_TEXT,
+    OP_CREATE_TILEMAP,
+    OP_SET_TILE,
+    OP_DRAW_TILEMAP,
+    OP_RENDER_EX,
+    OP_RENDER_DEPTH,
+    OP_FLUSH_LAYERS,
+    OP_LOAD_TEXTURE_EX,
+    OP_RELEASE_TEXTURE,
+    OP_SET_TEXTURE_BUDGET,
+    OP_SET_SWAP_INTERVAL,
+    OP_ENABLE_GPU_TIMERS,
+    OP_CREATE_LAYER,
+    OP_BEGIN_LAYER,
+    OP_END_LAYER,
+    OP_RENDER_AFFINE,
+    OP_RELEASE_STATIC_BATCH,
+    OP_RELEASE_TILEMAP,
+};
+
+// Recorded handles are remapped to the ones the replay backend returns.
+// Both the backend and the render thread's game side reuse released 
+// handles, so recorded ones stay well below this.
+const int HANDLES_MAX = 4096;
+
+struct HandleMap
+{
+    HandleMap()
+    {
+        for (int i=0; i<HANDLES_MAX; i++) {
+            handles[i] = i;
+        }
+    }
+
+    void set(int recorded, int actual)
+    {
+        if (recorded >= 0 && recorded < HANDLES_MAX) {
+            handles[recorded] = actual;
+        }
+    }
+
+    int get(int recorded) const
+    {
+        if (recorded >= 0 && recorded < HANDLES_MAX) {
+            return handles[recorded];
+        }
+        return -1;
+    }
+
+    int handles[HANDLES_MAX];
+};
+
+// Reads either a trace file or a queue a render thread is fed through
+struct TraceReader
+{
+    TraceReader(FILE* aFile): file(aFile), queue(NULL)
+    {
+    }
+
+    TraceReader(CommandQueue* aQueue): file(NULL), queue(aQueue)
+    {
+    }
+
+    template <class T>
+    bool read(T& value)
+    {
+        return readBytes(&value, sizeof(T));
+    }
+
+    bool readBytes(void* data, size_t size)
+    {
+        if (queue != NULL) {
+            return queue->read(data, size);
+        }
+        return fread(data, 1, size, file) == size;
+    }
+
+    // Strings are stored as int32 length and the bytes, no terminator
+    char* readString()
+    {
+        int len = 0;
+        if (!read(len) || len < 0) {
+            return NULL;
+        }
+        char* str = new char[len+1];
+        if (!readBytes(str, len)) 
+        {
+            delete[] str;
+            return NULL;
+        }
+        str[len] = '\0';
+        return str;
+    }
+
+    FILE* file;
+    CommandQueue* queue;
+};
+
+}  // anonymous namespace
+
+struct TraceRecorder
+{
+public:
+    TraceRecorder(FILE* aFile): file(aFile), queue(NULL), uncommitted(0)
+    {
+        // Render records are small and frequent, don't hit the OS for each
+        setvbuf(file, NULL, _IOFBF, 1 << 16);
+        writeHeader();
+    }
+
+    TraceRecorder(CommandQueue* aQueue): file(NULL), queue(aQueue), uncommitted(0)
+    {
+        writeHeader();
+    }
+
+    ~TraceRecorder()
+    {
+        if (queue != NULL) {
+            queue->close();
+        } else {
+            fclose(file);
+        }
+    }
+
+    void writeOp(TraceOp op)
+    {
+        // The previous records are complete, hand them over to the reader
+        // once there's enough to be worth the interlocked write
+        if (uncommitted >= COMMIT_BYTES) {
+            flush();
+        }
+        write((unsigned char)op);
+    }
+
+    template <class T>
+    void write(const T& value)
+    {
+        writeBytes(&value, sizeof(T));
+    }
+
+    void writeBytes(const void* data, size_t size)
+    {
+        if (queue != NULL) 
+        {
+            queue->write(data, size);
+            uncommitted += size;
+        } 
+        else 
+        {
+            fwrite(data, 1, size, file);
+        }
+    }
+
+    // Files stay buffered, only queue readers wait for the records
+    void flush()
+    {
+        if (queue != NULL) {
+            queue->commit();
+        }
+        uncommitted = 0;
+    }
+
+    // Commits first, like flush()
+    void waitIdle()
+    {
+        if (queue != NULL) {
+            queue->waitIdle();
+        }
+        uncommitted = 0;
+    }
+
+    // NULL data is a blank texture, stored as zeros like addTexture fills it
+    void writeTexels(const unsigned char* data, int w, int h)
+    {
+        size_t size = (size_t)w*h*4;
+        if (data != NULL) 
+        {
+            writeBytes(data, size);
+            return;
+        }
+
+        static const unsigned char zeros[1024] = { 0 };
+        while (size > 0)
+        {
+            size_t len = size < sizeof(zeros) ? size : sizeof(zeros);
+            writeBytes(zeros, len);
+            size -= len;
+        }
+    }
+
+    void writeString(const char* str)
+    {
+        int len = (int)strlen(str);
+        write(len);
+        writeBytes(str, len);
+    }
+
+private:
+    void writeHeader()
+    {
+        writeBytes(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+        write(TRACE_VERSION);
+    }
+
+    static const size_t COMMIT_BYTES = 4096;
+
+    FILE* file;
+    CommandQueue* queue;
+    size_t uncommitted;
+};
+
+TraceRecorder* Trace_CreateRecorder(const char* path)
+{
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        return NULL;
+    }
+    return new TraceRecorder(file);
+}
+
+TraceRecorder* Trace_CreateQueueRecorder(CommandQueue* queue)
+{
+    return new TraceRecorder(queue);
+}
+
+void Trace_LoadTexture(TraceRecorder* rec, int hTexture, const unsigned char* data, int w, int h)
+{
+    if (rec != NULL) {
+        rec->writeOp(OP_LOAD_TEXTURE);
+        rec->write(hTexture);
+        rec->write(w);
+        rec->write(h);
+        rec->writeTexels(data, w, h);
+    }
+}
+
+void Trace_LoadTextureEx(TraceRecorder* rec, int hTexture, const unsigned char* data, int w, int h, int format)
+{
+    if (rec != NULL) {
+        rec->writeOp(OP_LOAD_TEXTURE_EX);
+        rec->write(hTexture);
+        rec->write(w);
+        rec->write(h);
+        rec->write(format);
+        rec->writeTexels(data, w, h);
+    }
+}
+
+void Trace_ReleaseTexture(TraceRecorder* rec, int hTexture)
+{
+    if (rec != NULL) {
+        rec->writeOp(OP_RELEASE_TEXTURE);
+        rec->write(hTexture);
+    }
+}
+
+void Trace_SetTextureBudget(TraceRecorder* rec, int bytes)
+{
+    if (rec != NULL) {
+        rec->writeOp(OP_SET_TEXTURE_BUDGET);
+        rec->write(bytes);
+    }
+}
+
+void Trace_EnableGpuTimers(TraceRecorder* rec, int enable)
+{
+    if (rec != NULL) {
+        rec->writeOp(OP_ENABLE_GPU_TIMERS);
+        rec->write(enable);
+    }
+}
+
+void Trace_SetTexture(TraceRecorder* rec, int hTexture)
+{
+    if (rec != NULL) {
+        rec->writeOp(OP_SET_TEXTURE);
+        rec->write(hTexture);
+    }
+}
+
+void Trace_ClearScreen(TraceRecorder* rec, float r, float g, float b)
+{
+    if (rec != NULL) {
+        float rgb[] = { r, g, b };
+        rec->writeOp(OP_CLEAR_SCREEN);
+        rec->write(rgb);
+    }
+}
+
+void Trace_Render(TraceRecorder* rec, 
+                  float sx, float sy, 
+                  float sw, float sh, 
+                  float tx, float ty, 
+                  float tw, float th)
+{
+    if (rec != NULL) {
+        float quad[] = { sx, sy, sw, sh, tx, ty, tw, th };
+        rec->writeOp(OP_RENDER);
+        rec->write(quad);
+    }
+}
+
+void Trace_RenderEx(TraceRecorder* rec, 
+                    float sx, float sy, 
+                    float sw, float sh, 
+                    float tx, float ty, 
+                    float tw, float th,
+                    float pivotX, float pivotY,
+                    float rotation, float scaleX, float scaleY,
+                    unsigned int color)
+{
+    if (rec != NULL) {
+        float args[] = { sx, sy, sw, sh, tx, ty, tw, th, pivotX, pivotY, rotation, scaleX, scaleY };
+        rec->writeOp(OP_RENDER_EX);
+        rec->write(args);
+        rec->write(color);
+    }
+}
+
+void Trace_RenderAffine(TraceRecorder* rec, 
+                        const float* transform,
+                        float sx, float sy, 
+                        float sw, float sh, 
+                        float tx, float ty, 
+                        float tw, float th,
+                        unsigned int color)
+{
+    if (rec != NULL) {
+        float args[] = { transform[0], transform[1], transform[2], transform[3], transform[4], transform[5],
+                         sx, sy, sw, sh, tx, ty, tw, th };
+        rec->writeOp(OP_RENDER_AFFINE);
+        rec->write(args);
+        rec->write(color);
+    }
+}
+
+void Trace_RenderDepth(TraceRecorder* rec, 
+                       float sx, float sy, 
+                       float sw, float sh, 
+                       float tx, float ty, 
+                       float tw, float th,
+                       float depth, int opaque)
+{
+    if (rec != NULL) {
+        float args[] = { sx, sy, sw, sh, tx, ty, tw, th, depth };
+        rec->writeOp(OP_RENDER_DEPTH);
+        rec->write(args);
+        rec->write((unsigned char)(opaque != 0));
+    }
+}
+
+void Trace_FlushLayers(TraceRecorder* rec)
+{
+    if (rec != NULL) {
+        rec->writeOp(OP_FLUSH_LAYERS);
+    }
+}
+
+void Trace_CreateLayer(TraceRecorder* rec, int hLayer, int w, int h)
+{
+    if (rec != NULL) {
+        rec->writeOp(OP_CREATE_LAYER);
+        rec->write(hLayer);
+        rec->write(w);
+        rec->write(h);
+    }
+}
+
+void Trace_BeginLayer(TraceRecorder* rec, int hLayer)
+{
+    if (rec != NULL) {
+        rec->writeOp(OP_BEGIN_LAYER);
+        rec->write(hLayer);
+    }
+}
+
+void Trace_EndLayer(TraceRecorder* rec)
+{
+    if (rec != NULL) {
+        rec->writeOp(OP_END_LAYER);
+    }
+}
+
+void Trace_CreateStaticBatch(TraceRecorder* rec, int hBatch, int hTexture, const float* quads, int quadsLen)
+{
+    if (rec != NULL) {
+        rec->writeOp(OP_CREATE_STATIC_BATCH);
+        rec->write(hBatch);
+        rec->write(hTexture);
+        rec->write(quadsLen);
+        rec->writeBytes(quads, (size_t)quadsLen*8*sizeof(float));
+    }
+}
+
+void Trace_ReleaseStaticBatch(TraceRecorder* rec, int hBatch)
+{
+    if (rec != NULL) {
+        rec->writeOp(OP_RELEASE_STATIC_BATCH);
+        rec->write(hBatch);
+    }
+}
+
+void Trace_DrawStaticBatch(TraceRecorder* rec, int hBatch, float dx, float dy)
+{
+    if (rec != NULL) {
+        rec->writeOp(OP_DRAW_STATIC_BATCH);
+        rec->write(hBatch);
+        rec->write(dx);
+        rec->write(dy);
+    }
+}
+
+void Trace_CreateTilemap(TraceRecorder* rec, int hTilemap, int hTexture, int w, int h, 
+                         int tileSize, int atlasColumns, int atlasRows)
+{
+    if (rec != NULL) {
+        int args[] = { hTilemap, hTexture, w, h, tileSize, atlasColumns, atlasRows };
+        rec->writeOp(OP_CREATE_TILEMAP);
+        rec->write(args);
+    }
+}
+
+void Trace_ReleaseTilemap(TraceRecorder* rec, int hTilemap)
+{
+    if (rec != NULL) {
+        rec->writeOp(OP_RELEASE_TILEMAP);
+        rec->write(hTilemap);
+    }
+}
+
+void Trace_SetTile(TraceRecorder* rec, int hTilemap, int x, int y, int tile)
+{
+    if (rec != NULL) {
+        int args[] = { hTilemap, x, y, tile };
+        rec->writeOp(OP_SET_TILE);
+        rec->write(args);
+    }
+}
+
+void Trace_DrawTilemap(TraceRecorder* rec, int hTilemap, float scrollX, float scrollY)
+{
+    if (rec != NULL) {
+        rec->writeOp(OP_DRAW_TILEMAP);
+        rec->write(hTilemap);
+        rec->write(scrollX);
+        rec->write(scrollY);
+    }
+}
+
+void Trace_LoadFont(TraceRecorder* rec, int hFont, const char* face, int pixelSize, int flags)
+{
+    if (rec != NULL) {
+        rec->writeOp(OP_LOAD_FONT);
+        rec->write(hFont);
+        rec->write(pixelSize);
+        rec->write(flags);
+        rec->writeString(face);
+    }
+}
+
+void Trace_RenderText(TraceRecorder* rec, int hFont, float x, float y, float scale, 
+                      unsigned int color, const char* text)
+{
+    if (rec != NULL) {
+        rec->writeOp(OP_RENDER_TEXT);
+        rec->write(hFont);
+        rec->write(x);
+        rec->write(y);
+        rec->write(scale);
+        rec->write(color);
+        rec->writeString(text);
+    }
+}
+
+void Trace_MouseButtonState(TraceRecorder* rec, int state)
+{
+    if (rec != NULL) {
+        rec->writeOp(OP_MOUSE_BUTTON_STATE);
+        rec->write(state);
+    }
+}
+
+void Trace_MousePos(TraceRecorder* rec, int x, int y)
+{
+    if (rec != NULL) {
+        rec->writeOp(OP_MOUSE_POS);
+        rec->write(x);
+        rec->write(y);
+    }
+}
+
+void Trace_Resize(TraceRecorder* rec, int w, int h)
+{
+    if (rec != NULL) {
+        rec->writeOp(OP_RESIZE);
+        rec->write(w);
+        rec->write(h);
+    }
+}
+
+void Trace_SetSwapInterval(TraceRecorder* rec, int interval)
+{
+    if (rec != NULL) {
+        rec->writeOp(OP_SET_SWAP_INTERVAL);
+        rec->write(interval);
+    }
+}
+
+void Trace_EndFrame(TraceRecorder* rec)
+{
+    if (rec != NULL) {
+        rec->writeOp(OP_END_FRAME);
+        rec->flush();
+    }
+}
+
+void Trace_WaitIdle(TraceRecorder* rec)
+{
+    if (rec != NULL) {
+        rec->waitIdle();
+    }
+}
+
+void Trace_ReleaseRecorder(TraceRecorder* rec)
+{
+    delete rec;
+}
+
+// Live streams come from a running game, recorded ones are played back 
+// as fast as possible and leave the swap interval alone
+static int replayStream(TraceReader& in, SysAPI* sys, const TraceReplayHooks* hooks, bool live)
+{
+    char magic[sizeof(TRACE_MAGIC)];
+    int version = 0;
+    if (!in.readBytes(magic, sizeof(magic)) 
+        || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0
+        || !in.read(version) 
+        || version != TRACE_VERSION)
+    {
+        return -1;
+    }
+
+    HandleMap textures;
+    HandleMap batches;
+    HandleMap fonts;
+    HandleMap tilemaps;
+    int frames = 0;
+    bool ok = true;
+    bool stop = false;
+    unsigned char op = 0;
+
+    while (ok && !stop && in.read(op))
+    {
+        switch (op)
+        {
+            case OP_LOAD_TEXTURE:
+            {
+                int hTexture = 0, w = 0, h = 0;
+                ok = in.read(hTexture) && in.read(w) && in.read(h) && w > 0 && h > 0;
+                if (ok) {
+                    unsigned char* data = new unsigned char[(size_t)w*h*4];
+                    ok = in.readBytes(data, (size_t)w*h*4);
+                    if (ok && hTexture >= 0) {
+                        textures.set(hTexture, Sys_LoadTexture(sys, data, w, h));
+                    }
+                    delete[] data;
+                }
+                break;
+            }
+
+            case OP_LOAD_TEXTURE_EX:
+            {
+                int hTexture = 0, w = 0, h = 0, format = 0;
+                ok = in.read(hTexture) && in.read(w) && in.read(h) && in.read(format) 
+                    && w > 0 && h > 0;
+                if (ok) {
+                    unsigned char* data = new unsigned char[(size_t)w*h*4];
+                    ok = in.readBytes(data, (size_t)w*h*4);
+                    if (ok && hTexture >= 0) {
+                        textures.set(hTexture, Sys_LoadTextureEx(sys, data, w, h, format));
+                    }
+                    delete[] data;
+                }
+                break;
+            }
+
+            case OP_RELEASE_TEXTURE:
+            {
+                int hTexture = 0;
+                ok = in.read(hTexture);
+                if (ok) {
+                    Sys_ReleaseTexture(sys, textures.get(hTexture));
+                    textures.set(hTexture, -1);
+                }
+                break;
+            }
+
+            case OP_SET_TEXTURE_BUDGET:
+            {
+                int bytes = 0;
+                ok = in.read(bytes);
+                if (ok) {
+                    Sys_SetTextureBudget(sys, bytes);
+                }
+                break;
+            }
+
+            case OP_ENABLE_GPU_TIMERS:
+            {
+                int enable = 0;
+                ok = in.read(enable);
+                if (ok) {
+                    Sys_EnableGpuTimers(sys, enable);
+                }
+                break;
+            }
+
+            case OP_SET_TEXTURE:
+            {
+                int hTexture = 0;
+                ok = in.read(hTexture);
+                if (ok) {
+                    Sys_SetTexture(sys, textures.get(hTexture));
+                }
+                break;
+            }
+
+            case OP_CLEAR_SCREEN:
+            {
+                float rgb[3];
+                ok = in.read(rgb);
+                if (ok) {
+                    Sys_ClearScreen(sys, rgb[0], rgb[1], rgb[2]);
+                }
+                break;
+            }
+
+            case OP_RENDER:
+            {
+                float q[8];
+                ok = in.read(q);
+                if (ok) {
+                    Sys_Render(sys, q[0], q[1], q[2], q[3], q[4], q[5], q[6], q[7]);
+                }
+                break;
+            }
+
+            case OP_RENDER_EX:
+            {
+                float a[13];
+                unsigned int color = 0;
+                ok = in.read(a) && in.read(color);
+                if (ok) {
+                    Sys_RenderEx(sys, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], 
+                                 a[8], a[9], a[10], a[11], a[12], color);
+                }
+                break;
+            }
+
+            case OP_RENDER_AFFINE:
+            {
+                float a[14];
+                unsigned int color = 0;
+                ok = in.read(a) && in.read(color);
+                if (ok) {
+                    Sys_RenderAffine(sys, a, a[6], a[7], a[8], a[9], a[10], a[11], a[12], a[13], color);
+                }
+                break;
+            }
+
+            case OP_RENDER_DEPTH:
+            {
+                float a[9];
+                unsigned char opaque = 0;
+                ok = in.read(a) && in.read(opaque);
+                if (ok) {
+                    Sys_RenderDepth(sys, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8], opaque);
+                }
+                break;
+            }
+
+            case OP_FLUSH_LAYERS:
+            {
+                Sys_FlushLayers(sys);
+                break;
+            }
+
+            case OP_CREATE_LAYER:
+            {
+                int hLayer = 0, w = 0, h = 0;
+                ok = in.read(hLayer) && in.read(w) && in.read(h);
+                if (ok && hLayer >= 0) {
+                    textures.set(hLayer, Sys_CreateLayer(sys, w, h));
+                }
+                break;
+            }
+
+            case OP_BEGIN_LAYER:
+            {
+                int hLayer = 0;
+                ok = in.read(hLayer);
+                if (ok) {
+                    Sys_BeginLayer(sys, textures.get(hLayer));
+                }
+                break;
+            }
+
+            case OP_END_LAYER:
+            {
+                Sys_EndLayer(sys);
+                break;
+            }
+
+            case OP_CREATE_STATIC_BATCH:
+            {
+                int hBatch = 0, hTexture = 0, quadsLen = 0;
+                ok = in.read(hBatch) && in.read(hTexture) && in.read(quadsLen) && quadsLen >= 0;
+                if (ok) {
+                    float* quads = new float[(size_t)quadsLen*8 + 1];
+                    ok = in.readBytes(quads, (size_t)quadsLen*8*sizeof(float));
+                    if (ok && hBatch >= 0) {
+                        batches.set(hBatch, Sys_CreateStaticBatch(sys, textures.get(hTexture), quads, quadsLen));
+                    }
+                    delete[] quads;
+                }
+                break;
+            }
+
+            case OP_RELEASE_STATIC_BATCH:
+            {
+                int hBatch = 0;
+                ok = in.read(hBatch);
+                if (ok) {
+                    Sys_ReleaseStaticBatch(sys, batches.get(hBatch));
+                    batches.set(hBatch, -1);
+                }
+                break;
+            }
+
+            case OP_DRAW_STATIC_BATCH:
+            {
+                int hBatch = 0;
+                float dx = 0.f, dy = 0.f;
+                ok = in.read(hBatch) && in.read(dx) && in.read(dy);
+                if (ok) {
+                    Sys_DrawStaticBatch(sys, batches.get(hBatch), dx, dy);
+                }
+                break;
+            }
+
+            case OP_LOAD_FONT:
+            {
+                int hFont = 0, pixelSize = 0, flags = 0;
+                ok = in.read(hFont) && in.read(pixelSize) && in.read(flags);
+                char* face = ok ? in.readString() : NULL;
+                ok = face != NULL;
+                if (ok && hFont >= 0) {
+                    fonts.set(hFont, Sys_LoadFont(sys, face, pixelSize, flags));
+                }
+                delete[] face;
+                break;
+            }
+
+            case OP_RENDER_TEXT:
+            {
+                int hFont = 0;
+                float x = 0.f, y = 0.f, scale = 0.f;
+                unsigned int color = 0;
+                ok = in.read(hFont) && in.read(x) && in.read(y) && in.read(scale) && in.read(color);
+                char* text = ok ? in.readString() : NULL;
+                ok = text != NULL;
+                if (ok) {
+                    Sys_RenderText(sys, fonts.get(hFont), x, y, scale, color, text);
+                }
+                delete[] text;
+                break;
+            }
+
+            case OP_CREATE_TILEMAP:
+            {
+                int a[7];
+                ok = in.read(a);
+                if (ok && a[0] >= 0) {
+                    tilemaps.set(a[0], Sys_CreateTilemap(sys, textures.get(a[1]), a[2], a[3], a[4], a[5], a[6]));
+                }
+                break;
+            }
+
+            case OP_RELEASE_TILEMAP:
+            {
+                int hTilemap = 0;
+                ok = in.read(hTilemap);
+                if (ok) {
+                    Sys_ReleaseTilemap(sys, tilemaps.get(hTilemap));
+                    tilemaps.set(hTilemap, -1);
+                }
+                break;
+            }
+
+            case OP_SET_TILE:
+            {
+                int a[4];
+                ok = in.read(a);
+                if (ok) {
+                    Sys_SetTile(sys, tilemaps.get(a[0]), a[1], a[2], a[3]);
+                }
+                break;
+            }
+
+            case OP_DRAW_TILEMAP:
+            {
+                int hTilemap = 0;
+                float scrollX = 0.f, scrollY = 0.f;
+                ok = in.read(hTilemap) && in.read(scrollX) && in.read(scrollY);
+                if (ok) {
+                    Sys_DrawTilemap(sys, tilemaps.get(hTilemap), scrollX, scrollY);
+                }
+                break;
+            }
+
+            case OP_MOUSE_BUTTON_STATE:
+            {
+                int state = 0;
+                ok = in.read(state);
+                break;
+            }
+
+            case OP_MOUSE_POS:
+            {
+                int pos[2];
+                ok = in.read(pos);
+                break;
+            }
+
+            case OP_SET_SWAP_INTERVAL:
+            {
+                int interval = 0;
+                ok = in.read(interval);
+                if (ok && live) {
+                    Sys_SetSwapInterval(sys, interval);
+                }
+                break;
+            }
+
+            case OP_RESIZE:
+            {
+                int w = 0, h = 0;
+                ok = in.read(w) && in.read(h);
+                if (ok && hooks != NULL && hooks->resize != NULL) {
+                    hooks->resize(hooks->user, w, h);
+                }
+                break;
+            }
+
+            case OP_END_FRAME:
+            {
+                frames++;
+                if (hooks != NULL && hooks->endFrame != NULL) {
+                    stop = hooks->endFrame(hooks->user) != 0;
+                }
+                break;
+            }
+
+            default:
+                ok = false;
+                break;
+        }
+    }
+
+    return frames;
+}
+
+int Trace_Replay(const char* path, SysAPI* sys, const TraceReplayHooks* hooks)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return -1;
+    }
+    setvbuf(file, NULL, _IOFBF, 1 << 16);
+
+    TraceReader in(file);
+    int frames = replayStream(in, sys, hooks, false);
+    fclose(file);
+    return frames;
+}
+
+int Trace_ReplayQueue(CommandQueue* queue, SysAPI* sys, const TraceReplayHooks* hooks)
+{
+    TraceReader in(queue);
+    return replayStream(in, sys, hooks, true);
+}
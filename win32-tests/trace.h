@@ -0,0 +1,96 @@
+﻿#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct SysAPI;
+struct TraceRecorder;
+struct CommandQueue;
+
+// Recording side, called by the platform layer from inside Sys_* functions.
+// Handles are the ones the backend returned while recording.
+TraceRecorder* Trace_CreateRecorder(const char* path);
+// Records into a queue instead, for a render thread replaying the calls as
+// they come. Records reach the reader in blocks of about 4 KB, when the 
+// queue fills up, and at Trace_EndFrame or Trace_WaitIdle, which hand 
+// over whatever is pending. Releasing the recorder closes the queue.
+TraceRecorder* Trace_CreateQueueRecorder(CommandQueue* queue);
+void Trace_LoadTexture(TraceRecorder* rec, int hTexture, const unsigned char* data, int w, int h);
+void Trace_LoadTextureEx(TraceRecorder* rec, int hTexture, const unsigned char* data, int w, int h, int format);
+void Trace_ReleaseTexture(TraceRecorder* rec, int hTexture);
+void Trace_SetTextureBudget(TraceRecorder* rec, int bytes);
+void Trace_EnableGpuTimers(TraceRecorder* rec, int enable);
+void Trace_SetTexture(TraceRecorder* rec, int hTexture);
+void Trace_ClearScreen(TraceRecorder* rec, float r, float g, float b);
+void Trace_Render(TraceRecorder* rec, 
+                  float sx, float sy, 
+                  float sw, float sh, 
+                  float tx, float ty, 
+                  float tw, float th);
+void Trace_RenderEx(TraceRecorder* rec, 
+                    float sx, float sy, 
+                    float sw, float sh, 
+                    float tx, float ty, 
+                    float tw, float th,
+                    float pivotX, float pivotY,
+                    float rotation, float scaleX, float scaleY,
+                    unsigned int color);
+void Trace_RenderAffine(TraceRecorder* rec, 
+                        const float* transform,
+                        float sx, float sy, 
+                        float sw, float sh, 
+                        float tx, float ty, 
+                        float tw, float th,
+                        unsigned int color);
+void Trace_RenderDepth(TraceRecorder* rec, 
+                       float sx, float sy, 
+                       float sw, float sh, 
+                       float tx, float ty, 
+                       float tw, float th,
+                       float depth, int opaque);
+void Trace_FlushLayers(TraceRecorder* rec);
+void Trace_CreateLayer(TraceRecorder* rec, int hLayer, int w, int h);
+void Trace_BeginLayer(TraceRecorder* rec, int hLayer);
+void Trace_EndLayer(TraceRecorder* rec);
+void Trace_CreateStaticBatch(TraceRecorder* rec, int hBatch, int hTexture, const float* quads, int quadsLen);
+void Trace_ReleaseStaticBatch(TraceRecorder* rec, int hBatch);
+void Trace_DrawStaticBatch(TraceRecorder* rec, int hBatch, float dx, float dy);
+void Trace_CreateTilemap(TraceRecorder* rec, int hTilemap, int hTexture, int w, int h, 
+                         int tileSize, int atlasColumns, int atlasRows);
+void Trace_ReleaseTilemap(TraceRecorder* rec, int hTilemap);
+void Trace_SetTile(TraceRecorder* rec, int hTilemap, int x, int y, int tile);
+void Trace_DrawTilemap(TraceRecorder* rec, int hTilemap, float scrollX, float scrollY);
+void Trace_LoadFont(TraceRecorder* rec, int hFont, const char* face, int pixelSize, int flags);
+void Trace_RenderText(TraceRecorder* rec, int hFont, float x, float y, float scale, 
+                      unsigned int color, const char* text);
+void Trace_MouseButtonState(TraceRecorder* rec, int state);
+void Trace_MousePos(TraceRecorder* rec, int x, int y);
+void Trace_Resize(TraceRecorder* rec, int w, int h);
+void Trace_SetSwapInterval(TraceRecorder* rec, int interval);
+void Trace_EndFrame(TraceRecorder* rec);
+// Returns once the reader of a queue recorder has replayed everything 
+// recorded so far, doesn't wait for file recorders
+void Trace_WaitIdle(TraceRecorder* rec);
+void Trace_ReleaseRecorder(TraceRecorder* rec);
+
+struct TraceReplayHooks
+{
+    void* user;
+    void (*resize)(void* user, int w, int h);
+    // Return non-zero to stop the replay early
+    int  (*endFrame)(void* user);
+};
+
+// Feeds a recorded trace into sys as fast as possible. Input queries are
+// skipped, since the backend doesn't consume them, and so are creations
+// that failed while recording (handle -1). Returns the number of frames 
+// replayed, or -1 if the file is not a valid trace.
+int Trace_Replay(const char* path, SysAPI* sys, const TraceReplayHooks* hooks);
+// Same for a queue fed by Trace_CreateQueueRecorder, until it gets closed.
+// Swap interval changes are applied here.
+int Trace_ReplayQueue(CommandQueue* queue, SysAPI* sys, const TraceReplayHooks* hooks);
+
+#ifdef __cplusplus
+}
+#endif